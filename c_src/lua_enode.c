@@ -10,6 +10,7 @@ Lua -> Erlang
 	erl_atom"string" -> 'string' Atom
 
 	integer number -> Integer Number
+		/ Including floats with an integral value that fits in 64 bits
 	floating point number -> Float Number
 
 	"string" -> Binary
@@ -18,6 +19,12 @@ Lua -> Erlang
 
 	erl_tuple{ V1, V2, V3, ..., Vn } -> { V1, V2, V3, ..., Vn }
 
+	erl_array(type, ...) -> Binary
+		/ The packed elements in native byte order
+
+	erl_encoded(V) -> V
+		/ As V was when erl_encoded was called; encoded only then
+
 	{ V1, V2, V3, ..., Vn } -> [ V1, V2, V3, ..., Vn ]
 
 	{ K1=V1, K2=V2, K3=V3, ..., Kn=Vn } -> [ {K1, V1}, {K2, V2}, {K3, V3}, ..., {Kn, Vn} ]
@@ -45,11 +52,17 @@ Erlang -> Lua
 	Atom -> string
 
 	Integer Number -> number
+		/ An integer with Lua 5.3 and later, if it fits in 64 bits;
+		/ otherwise, and with Lua 5.1, 5.2 and LuaJIT, the nearest float
 	Float Number -> number
 
 	Binary -> string
 	/ Note: Regular Erlang Strings are Lists: "abc" -> { 97, 98, 99 }
 
+	{ erl_array, Type, Binary } -> erl_array userdata
+		/ Type is one of the atoms f64, i32 or i64
+		/ Binary holds the packed elements in native byte order
+
 	{ V1, V2, V3, ..., Vn } -> { V1, V2, V3, ..., Vn }
 	[ V1, V2, V3, ..., Vn ] -> { V1, V2, V3, ..., Vn }
 
@@ -71,13 +84,20 @@ Erlang -> Lua
 #	include <shlwapi.h>
 #else
 #	include <sys/types.h>
+#	include <sys/mman.h>
+#	include <sys/select.h>
 #	include <sys/socket.h>
+#	include <sys/stat.h>
+#	include <unistd.h>
 #	include <netdb.h>
 #	include <netinet/in.h>
 #endif
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -94,11 +114,35 @@ extern void erl_init(void *hp,long heap_size);
 #include "lualib.h"
 #include "lauxlib.h"
 
-#if LUA_VERSION_NUM==502
+#if LUA_VERSION_NUM >= 502
 #	define lua_objlen lua_rawlen
 #endif
 
 
+/*
+ * Every exec or call request runs as a task: a coroutine of its own
+ * on the one Lua state.  A task that waits for an erl_rpc reply, or
+ * gives way with erl_yield(), is suspended, and the main message loop
+ * goes on with other requests until it can be resumed.
+ */
+enum { TASK_RUNNING, TASK_READY, TASK_WAITING };
+
+struct erl_task {
+	long tag;           /* the request's tag; the reply is sent as { reply, Tag, Reply } */
+	erlang_pid pid;     /* where the reply goes */
+	lua_State *L;       /* the task's coroutine */
+	int ref;            /* registry reference keeping the coroutine alive */
+	int state;
+	struct erl_dataset_pin *datasets;  /* the dataset versions the task keeps until it finishes */
+	struct erl_task *next;
+};
+
+/* A message put aside while erl_rpc waited outside of a task. */
+struct erl_deferred {
+	ei_x_buff x;
+	struct erl_deferred *next;
+};
+
 /* WARNING: GLOBAL VARIABLE: EI_LUA_STATE */
 struct {
 	lua_State *L;
@@ -110,16 +154,36 @@ struct {
 	ei_x_buff x_out;
 	ei_x_buff x_rpc_in;
 	ei_x_buff x_rpc_out;
+
+	int unlinked;       /* the Erlang node went away while erl_rpc was waiting */
+	struct erl_task *tasks;  /* oldest first */
+	struct erl_deferred *deferred;
+	struct erl_task *running;  /* the task being resumed, if any */
 } EI_LUA_STATE;
 
 static int handle_msg(erlang_pid *pid);
 static void main_message_loop();
 static int start_lua();
 static void stop_lua();
-static void execute_code(lua_State *L, ei_x_buff *x_out, char *code);
-static void execute_call(lua_State *L, ei_x_buff *x_in, ei_x_buff *x_out, char *fun, int arity, unsigned char *args_str);
+static int start_exec(struct erl_task *task, char *code, const char *env);
+static int start_call(struct erl_task *task, ei_x_buff *x_in, char *fun, int arity, unsigned char *args_str, const char *env);
+static struct erl_task *new_task(erlang_pid *pid, long tag);
+static void resume_task(struct erl_task *task, int nargs);
+static void release_datasets(struct erl_task *task);
+static void task_error(struct erl_task *task, const char *reason);
+static void open_erl_envs(lua_State *L);
+static void push_env(lua_State *L, const char *env);
+static void drop_env(lua_State *L, const char *env);
 static int erlang_to_lua(lua_State *L, ei_x_buff *x_buff, int in_list);
+static void push_int64(lua_State *L, int64_t v);
 static void lua_to_erlang(lua_State *L, ei_x_buff *x_out, int i);
+static void open_erl_array(lua_State *L);
+static int is_erl_array_term(ei_x_buff *x_buff);
+static void erlang_to_erl_array(lua_State *L, ei_x_buff *x_buff);
+static int erl_array_to_erlang(lua_State *L, ei_x_buff *x_buff, int i);
+static void open_erl_encoded(lua_State *L);
+static int erl_encoded_to_erlang(lua_State *L, ei_x_buff *x_buff, int i);
+static void open_erl_dataset(lua_State *L);
 
 static void
 print(char *fmt, ...)
@@ -222,6 +286,63 @@ reconnect()
 	print("INFO: Lua Erlang Node reconnected.");
 }
 
+static void
+send_msg(erlang_pid *pid, ei_x_buff *x)
+{
+	if (ei_send(EI_LUA_STATE.fd, pid, x->buff, x->index) < 0) {
+		print("DEBUG: Lua Erlang Node error in send to '%s'.", pid->node);
+		reconnect();
+		if (ei_send(EI_LUA_STATE.fd, pid, x->buff, x->index) < 0) {
+			print("FATAL: Lua Erlang Node error in send to '%s'.", pid->node);
+			exit(8);
+		}
+	}
+}
+
+static int
+fd_readable(int fd)
+{
+	fd_set fds;
+	struct timeval tv = { 0, 0 };
+
+	FD_ZERO(&fds);
+	FD_SET(fd, &fds);
+	return select(fd + 1, &fds, NULL, NULL, &tv) > 0;
+}
+
+static int
+dispatch_msg()
+{
+	erlang_pid pid = { 0 };
+	int running;
+
+	EI_LUA_STATE.x_in.index = 0;
+	EI_LUA_STATE.x_out.index = 0;
+	running = handle_msg(&pid);
+	if (running == -1)
+		return 1;  /* Ignore messages without a return pid! */
+	if (EI_LUA_STATE.x_out.index > 0)
+		send_msg(&pid, &EI_LUA_STATE.x_out);
+	return running;
+}
+
+static struct erl_task *
+next_ready_task()
+{
+	struct erl_task *task;
+
+	for (task = EI_LUA_STATE.tasks; task != NULL; task = task->next) {
+		if (task->state == TASK_READY)
+			return task;
+	}
+	return NULL;
+}
+
+/*
+ * Messages put aside by erl_rpc are handled first, in the order they
+ * arrived.  Tasks that are ready to continue run only when no message
+ * is waiting, so that new requests and rpc replies are not held up.
+ */
 static void
 main_message_loop()
 {
@@ -229,11 +350,24 @@ main_message_loop()
 
 	int running = 1;
 	ei_x_buff *x_in = &EI_LUA_STATE.x_in;
-	ei_x_buff *x_out = &EI_LUA_STATE.x_out;
-	ei_x_buff *x_rpc_in = &EI_LUA_STATE.x_rpc_in;
-	ei_x_buff *x_rpc_out = &EI_LUA_STATE.x_rpc_out;
-
-	while (running) {
+	struct erl_task *task;
+
+	while (running && ! EI_LUA_STATE.unlinked) {
+		if (EI_LUA_STATE.deferred != NULL) {
+			struct erl_deferred *d = EI_LUA_STATE.deferred;
+			EI_LUA_STATE.deferred = d->next;
+			x_in->index = 0;
+			ei_x_append_buf(x_in, d->x.buff, d->x.index);
+			ei_x_free(&d->x);
+			free(d);
+			running = dispatch_msg();
+			continue;
+		}
+		if ((task = next_ready_task()) != NULL && ! fd_readable(EI_LUA_STATE.fd)) {
+			lua_settop(task->L, 0);
+			resume_task(task, 0);
+			continue;
+		}
 		x_in->index = 0;
 		switch (ei_xreceive_msg(EI_LUA_STATE.fd, &msg, x_in)) {
 		case ERL_ERROR:
@@ -256,30 +390,7 @@ main_message_loop()
 				break;
 			case ERL_SEND:
 			case ERL_REG_SEND:
-				{
-					erlang_pid pid = { 0 };
-					x_in->index = 0;
-					running = handle_msg(&pid);
-					if (running == -1) {
-						/* Ignore messages without a return pid! */
-						running = 1;
-					} else {
-						x_rpc_in->index = x_rpc_out->index = 0;
-						ei_x_encode_empty_list(x_rpc_in); /* empty param list for erlang:is_alive() */
-						if (ei_rpc(&EI_LUA_STATE.ec, EI_LUA_STATE.fd,
-								"erlang", "is_alive",
-								x_rpc_in->buff, x_rpc_in->index,
-								x_rpc_out) < 0) {
-							print("DEBUG: Lua Erlang Node error in 'is alive?' rpc to '%s'.", pid.node);
-							reconnect();
-						}
-						if (x_out->index > 0 && ei_send(EI_LUA_STATE.fd, &pid,
-								x_out->buff, x_out->index) < 0) {
-							print("FATAL: Lua Erlang Node error in send to '%s'.", pid.node);
-							exit(8);
-						}
-					}
-				}
+				running = dispatch_msg();
 				break;
 			}
 			break;
@@ -287,16 +398,39 @@ main_message_loop()
 	}
 }
 
+/* Starts a reply: { reply, Tag, Reply } for tagged requests, just Reply otherwise. */
 static void
-set_error_msg(ei_x_buff *x_out, const char *reason)
+begin_reply(ei_x_buff *x_out, long tag)
 {
 	x_out->index = 0;
 	ei_x_encode_version(x_out);
+	if (tag >= 0) {
+		ei_x_encode_tuple_header(x_out, 3);
+		ei_x_encode_atom(x_out, "reply");
+		ei_x_encode_long(x_out, tag);
+	}
+}
+
+static void
+set_error_msg(ei_x_buff *x_out, long tag, const char *reason)
+{
+	begin_reply(x_out, tag);
 	ei_x_encode_tuple_header(x_out, 2);
 	ei_x_encode_atom(x_out, "error");
 	ei_x_encode_string(x_out, reason);
 }
 
+/* Decodes the Result of an rpc_reply onto the main Lua stack; run under lua_pcall(). */
+static int
+decode_rpc_reply(lua_State *L)
+{
+	ei_x_buff *x_in = (ei_x_buff *) lua_touserdata(L, 1);
+
+	lua_pop(L, 1);
+	erlang_to_lua(L, x_in, 0);
+	return 1;
+}
+
 static int
 handle_msg(erlang_pid *pid)
 {
@@ -304,14 +438,28 @@ handle_msg(erlang_pid *pid)
 		{ stop, Caller_Pid, [], [] }
 		{ exec, Caller_Pid, Code, [] }
 		{ call, Caller_Pid, Function_Name, [Arg, ...] = Args }
+		{ drop_env, Caller_Pid, Env, [] }
+	   or any of these with a fifth element Env, and a sixth element Tag,
+	   or
+		{ rpc_reply, Pid, Tag, Result }
 	   with
 		stop - the atom 'stop'
 		exec - the atom 'exec'
 		call - the atom 'call'
+		drop_env - the atom 'drop_env'
 		Caller_Pid - the Pid of the Erlang process that sent the message
 		Code - the Lua code as a binary to 'exec' (ignored on 'stop')
 		Function_Name - function name as an atom to 'call' (ignored on 'stop')
 		Args - list of arguments to pass when first atom is 'call' (ignored on 'exec' and 'stop')
+		Env - the name of the environment, as an atom, to 'exec', 'call' or 'drop_env' in;
+			[] for the global environment
+		Tag - a non-negative integer identifying the request in its reply
+		rpc_reply - the atom 'rpc_reply'
+		Result - the result of the erl_rpc made by the task with the given Tag
+	   A tagged request has its erl_rpc calls made by Caller_Pid, which gets
+		{ rpc, Tag, Mod, Fun, Args }
+	   and must answer with rpc_reply; an untagged one makes them itself,
+	   through the rex server of Caller_Pid's node.
 	*/
 
 	ei_x_buff *x_in = &EI_LUA_STATE.x_in;
@@ -322,7 +470,10 @@ handle_msg(erlang_pid *pid)
 	int type;
 	int len;
 	char lua_atom[MAXATOMLEN+1] = {0};
-	char *code, *args_str;
+	char env[MAXATOMLEN+1] = {0};
+	char *code, *args_str = NULL;
+	long tag = -1;
+	struct erl_task *task;
 
 	if (ei_decode_version(x_in->buff, &x_in->index, &version) < 0) {
 		print("WARNING: Ignoring malformed message (bad version: %d).", version);
@@ -332,8 +483,8 @@ handle_msg(erlang_pid *pid)
 		print("WARNING: Ignoring malformed message (not tuple).");
 		return -1;
 	}
-	if (arity != 4) {
-		print("WARNING: Ignoring malformed message (not 4-arity tuple).");
+	if (arity < 4 || arity > 6) {
+		print("WARNING: Ignoring malformed message (not 4-arity, 5-arity or 6-arity tuple).");
 		return -1;
 	}
 	if (ei_decode_atom(x_in->buff, &x_in->index, lua_atom) < 0) {
@@ -345,19 +496,78 @@ handle_msg(erlang_pid *pid)
 		return -1;
 	}
 
+	if (strcmp(lua_atom, "rpc_reply") == 0) {
+		if (ei_decode_long(x_in->buff, &x_in->index, &tag) < 0) {
+			print("WARNING: Ignoring malformed message (third tuple element for 'rpc_reply' not integer).");
+			return -1;
+		}
+		for (task = EI_LUA_STATE.tasks; task != NULL; task = task->next) {
+			if (task->tag == tag && task->state == TASK_WAITING)
+				break;
+		}
+		if (task == NULL) {
+			print("WARNING: Ignoring rpc reply for unknown task %ld.", tag);
+			return -1;
+		}
+		/* decoding may raise a Lua error, which the suspended task cannot catch */
+		lua_pushcfunction(EI_LUA_STATE.L, decode_rpc_reply);
+		lua_pushlightuserdata(EI_LUA_STATE.L, x_in);
+		if (lua_pcall(EI_LUA_STATE.L, 1, 1, 0) != 0) {
+			task_error(task, lua_tostring(EI_LUA_STATE.L, -1));
+			lua_pop(EI_LUA_STATE.L, 1);
+			return 1;
+		}
+		lua_settop(task->L, 0);
+		lua_xmove(EI_LUA_STATE.L, task->L, 1);
+		resume_task(task, 1);
+		return 1;
+	}
+
+	if (arity >= 5) {
+		/* Peek at the Env and Tag; anything but an atom means the global environment. */
+		int index = x_in->index;
+		if (ei_skip_term(x_in->buff, &index) < 0
+				|| ei_skip_term(x_in->buff, &index) < 0
+				|| ei_decode_atom(x_in->buff, &index, env) < 0) {
+			env[0] = '\0';
+			index = x_in->index;
+			ei_skip_term(x_in->buff, &index);
+			ei_skip_term(x_in->buff, &index);
+			ei_skip_term(x_in->buff, &index);
+		}
+		if (arity == 6 && (ei_decode_long(x_in->buff, &index, &tag) < 0 || tag < 0)) {
+			print("WARNING: Ignoring malformed message (sixth tuple element not a non-negative integer).");
+			return -1;
+		}
+	}
+
 	if (strcmp(lua_atom, "stop") == 0) {
 		print("DEBUG: Lua Erlang Node stopping normally.");
 		x_out->index = 0;
 		return 0;
 	}
 
+	if (strcmp(lua_atom, "drop_env") == 0) {
+		if (ei_decode_atom(x_in->buff, &x_in->index, env) < 0) {
+			print("WARNING: Ignoring malformed message (third tuple element for 'drop_env' not atom).");
+			set_error_msg(x_out, tag, "Third tuple element is not an atom.");
+			return 1;
+		}
+		drop_env(EI_LUA_STATE.L, env);
+		begin_reply(x_out, tag);
+		ei_x_encode_tuple_header(x_out, 2);
+		ei_x_encode_atom(x_out, "lua");
+		ei_x_encode_atom(x_out, "ok");
+		return 1;
+	}
+
 	if (strcmp(lua_atom, "exec") == 0) {
 		ei_get_type(x_in->buff, &x_in->index, &type, &len);
 		code = (char *) calloc(len+1, sizeof(char));
 		if (ei_decode_binary(x_in->buff, &x_in->index, code, NULL) < 0) {
 			free(code);
 			print("WARNING: Ignoring malformed message (third tuple element for 'exec' not binary).");
-			set_error_msg(x_out, "Third tuple element is not a binary.");
+			set_error_msg(x_out, tag, "Third tuple element is not a binary.");
 			return 1;
 		}
 	} else if (strcmp(lua_atom, "call") == 0) {
@@ -365,7 +575,7 @@ handle_msg(erlang_pid *pid)
 		if (ei_decode_atom(x_in->buff, &x_in->index, code) < 0) {
 			free(code);
 			print("WARNING: Ignoring malformed message (third tuple element for 'call' not atom).");
-			set_error_msg(x_out, "Third tuple element is not an atom.");
+			set_error_msg(x_out, tag, "Third tuple element is not an atom.");
 			return -1;
 		}
 		ei_get_type(x_in->buff, &x_in->index, &type, &len);
@@ -379,37 +589,32 @@ handle_msg(erlang_pid *pid)
 			free(args_str);
 			free(code);
 			print("WARNING: Ignoring malformed message (fourth tuple element for 'call' not list).");
-			set_error_msg(x_out, "Fourth tuple element is not a list.");
-			return 1;
-		}
-		if (! lua_checkstack(EI_LUA_STATE.L, arity + 1)) {
-			free(args_str);
-			free(code);
-			print("WARNING: Insufficient Lua Stack space (could not reserve %d slots).", arity + 1);
-			set_error_msg(x_out, "Insufficient Lua Stack space.");
+			set_error_msg(x_out, tag, "Fourth tuple element is not a list.");
 			return 1;
 		}
 	} else {
-		print("WARNING: Ignoring malformed message (first tuple element not atom 'stop', 'exec'  or 'call').");
-		set_error_msg(x_out, "First tuple element is not the atom 'stop', 'exec' or 'call'.");
+		print("WARNING: Ignoring malformed message (first tuple element not atom 'stop', 'exec', 'call' or 'drop_env').");
+		set_error_msg(x_out, tag, "First tuple element is not the atom 'stop', 'exec', 'call' or 'drop_env'.");
 		return 1;
 	}
 
-	x_out->index = 0;
-	ei_x_encode_version(x_out);
-	ei_x_encode_tuple_header(x_out, 2);
-	ei_x_encode_atom(x_out, "lua");
+	task = new_task(pid, tag);
 	if (strcmp(lua_atom, "exec") == 0)
-		execute_code(EI_LUA_STATE.L, x_out, code);
-	else if (strcmp(lua_atom, "call") == 0)
-		execute_call(EI_LUA_STATE.L, x_in, x_out, code, arity, (unsigned char*) args_str);
+		arity = start_exec(task, code, env[0] ? env : NULL);
+	else
+		arity = start_call(task, x_in, code, arity, (unsigned char*) args_str, env[0] ? env : NULL);
+	if (arity >= 0)
+		resume_task(task, arity);
 
+	free(args_str);
 	free(code);
+	x_out->index = 0;  /* the task sends its own reply */
 	return 1;
 }
 
 
 static int lerl_rpc(lua_State *L);
+static int lerl_yield(lua_State *L);
 
 /*
  * A few "boxing" constructors and testers for Erlang types not
@@ -442,7 +647,7 @@ static const char *erl_functions_s = ""
 " "
 " function erl_tuple(t)"
 "	if type(t) == 'table' then"
-"		return { [_ERL_TUPLE] = true, unpack(t) }"
+"		return { [_ERL_TUPLE] = true, (table.unpack or unpack)(t) }"
 "	else"
 "		error[[bad argument #1 to 'erl_table' (table expected)]]"
 "	end"
@@ -466,10 +671,245 @@ start_lua()
 			return 0;
 		}
 		lua_register(EI_LUA_STATE.L, "erl_rpc", lerl_rpc);
+		lua_register(EI_LUA_STATE.L, "erl_yield", lerl_yield);
+		open_erl_array(EI_LUA_STATE.L);
+		open_erl_encoded(EI_LUA_STATE.L);
+		open_erl_dataset(EI_LUA_STATE.L);
+		open_erl_envs(EI_LUA_STATE.L);
 		return 1;
 	}
 }
 
+/*
+ * Named environments let several tenants share one Lua state.  Each
+ * environment is a table of its own globals, created on first use and
+ * kept in the registry table erl_envs.  Globals it does not define are
+ * looked up in the global environment through a shared metatable, so
+ * the libraries, the erl_* functions and anything loaded globally are
+ * visible to all environments, while assignments stay in the
+ * environment; _G refers to the environment itself.  The standard
+ * library tables (string, table, ...) are seen through read-only
+ * proxies, shared by all environments, so that no tenant can change
+ * them for the others.
+ *
+ * The shared metatable is protected, and each environment has its own
+ * load(), loadstring(), loadfile() and dofile(), which give the chunks
+ * they load the environment rather than the global one, and, with Lua
+ * 5.1, a getfenv() that returns the environment in its place.  This
+ * keeps tenants from writing to the global environment by accident,
+ * but is no sandbox: the debug library, require(), package.loaded and
+ * the metatable of strings still reach past it.
+ */
+
+#define ERL_ENVS "erl_envs"
+#define ERL_ENV_META "erl_env_meta"
+
+/* The library tables environments see through proxies, those that exist, that is. */
+static const char *erl_env_libs[] = {
+	"coroutine", "debug", "io", "math", "os", "package", "string", "table",
+	"utf8", "bit32", "bit", "jit", NULL
+};
+
+static int
+env_lib_newindex(lua_State *L)
+{
+	return luaL_error(L, "attempt to modify a shared library table");
+}
+
+#if LUA_VERSION_NUM >= 502
+/* pairs() on a proxy goes over the library; upvalues are next() and the library. */
+static int
+env_lib_pairs(lua_State *L)
+{
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_pushvalue(L, lua_upvalueindex(2));
+	lua_pushnil(L);
+	return 3;
+}
+#endif
+
+/*
+ * The environments' metatable looks globals up in a base table, which
+ * holds the library proxies and in turn looks up everything else in
+ * the global environment.
+ */
+static void
+open_erl_envs(lua_State *L)
+{
+	const char **lib;
+
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, ERL_ENVS);
+	lua_newtable(L);                                /* Stack: Meta */
+	lua_newtable(L);                                /* Stack: Base Meta */
+	for (lib = erl_env_libs; *lib != NULL; lib++) {
+		lua_getglobal(L, *lib);                     /* Stack: Lib Base Meta */
+		if (! lua_istable(L, -1)) {
+			lua_pop(L, 1);
+			continue;
+		}
+		lua_newtable(L);                            /* Stack: Proxy Lib Base Meta */
+		lua_createtable(L, 0, 4);                   /* Stack: ProxyMeta Proxy Lib Base Meta */
+		lua_pushvalue(L, -3);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, env_lib_newindex);
+		lua_setfield(L, -2, "__newindex");
+		lua_pushboolean(L, 0);
+		lua_setfield(L, -2, "__metatable");
+#if LUA_VERSION_NUM >= 502
+		lua_getglobal(L, "next");
+		lua_pushvalue(L, -4);
+		lua_pushcclosure(L, env_lib_pairs, 2);
+		lua_setfield(L, -2, "__pairs");
+#endif
+		lua_setmetatable(L, -2);                    /* Stack: Proxy Lib Base Meta */
+		lua_setfield(L, -3, *lib);                  /* Stack: Lib Base Meta */
+		lua_pop(L, 1);                              /* Stack: Base Meta */
+	}
+	lua_createtable(L, 0, 1);
+#if LUA_VERSION_NUM >= 502
+	lua_pushglobaltable(L);
+#else
+	lua_pushvalue(L, LUA_GLOBALSINDEX);
+#endif
+	lua_setfield(L, -2, "__index");
+	lua_setmetatable(L, -2);
+	lua_setfield(L, -2, "__index");                 /* Stack: Meta */
+	lua_pushboolean(L, 0);
+	lua_setfield(L, -2, "__metatable");
+	lua_setfield(L, LUA_REGISTRYINDEX, ERL_ENV_META);
+}
+
+static void bind_env_functions(lua_State *L);
+
+static void
+push_env(lua_State *L, const char *env)
+{
+	lua_getfield(L, LUA_REGISTRYINDEX, ERL_ENVS);   /* Stack: Envs */
+	lua_getfield(L, -1, env);                       /* Stack: Env Envs */
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);                              /* Stack: Envs */
+		lua_newtable(L);                            /* Stack: Env Envs */
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "_G");
+		lua_getfield(L, LUA_REGISTRYINDEX, ERL_ENV_META);
+		lua_setmetatable(L, -2);
+		bind_env_functions(L);
+		lua_pushvalue(L, -1);                       /* Stack: Env Env Envs */
+		lua_setfield(L, -3, env);                   /* Stack: Env Envs */
+	}
+	lua_remove(L, -2);                              /* Stack: Env */
+}
+
+static void
+drop_env(lua_State *L, const char *env)
+{
+	lua_getfield(L, LUA_REGISTRYINDEX, ERL_ENVS);
+	lua_pushnil(L);
+	lua_setfield(L, -2, env);
+	lua_pop(L, 1);
+}
+
+/* Pops a table off the stack and makes it the environment of the function at index i. */
+static void
+set_chunk_env(lua_State *L, int i)
+{
+	if (i < 0)
+		i = lua_gettop(L) + i + 1;
+#if LUA_VERSION_NUM >= 502
+	/* the first upvalue of a main chunk is its _ENV */
+	if (lua_setupvalue(L, i, 1) == NULL)
+		lua_pop(L, 1);
+#else
+	lua_setfenv(L, i);
+#endif
+}
+
+/*
+ * An environment's load(), loadstring() or loadfile(); upvalues are the
+ * global function, the environment, and the position of the function's
+ * own env argument (0 for none), which, if given, takes precedence.
+ */
+static int
+env_load(lua_State *L)
+{
+	int env_arg = (int) lua_tointeger(L, lua_upvalueindex(3));
+	int explicit_env = env_arg > 0 && lua_gettop(L) >= env_arg;
+
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_insert(L, 1);
+	lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+	if (lua_isfunction(L, 1) && ! explicit_env) {
+		lua_pushvalue(L, lua_upvalueindex(2));
+		set_chunk_env(L, 1);
+	}
+	return lua_gettop(L);
+}
+
+/* An environment's dofile(); the upvalue is the environment. */
+static int
+env_dofile(lua_State *L)
+{
+	const char *file = luaL_optstring(L, 1, NULL);
+
+	lua_settop(L, 1);
+	if (luaL_loadfile(L, file) != 0)
+		return lua_error(L);
+	lua_pushvalue(L, lua_upvalueindex(1));
+	set_chunk_env(L, -2);
+	lua_call(L, 0, LUA_MULTRET);
+	return lua_gettop(L) - 1;
+}
+
+#if LUA_VERSION_NUM < 502
+/* An environment's getfenv(); upvalues are the global function and the environment. */
+static int
+env_getfenv(lua_State *L)
+{
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_insert(L, 1);
+	lua_call(L, lua_gettop(L) - 1, 1);
+	if (lua_rawequal(L, -1, LUA_GLOBALSINDEX)) {
+		lua_pop(L, 1);
+		lua_pushvalue(L, lua_upvalueindex(2));
+	}
+	return 1;
+}
+#endif
+
+/* Sets env[name] to f, closed over the global function name and the environment, if there is such a global. */
+static void
+bind_env_function(lua_State *L, const char *name, lua_CFunction f, int env_arg)
+{
+	lua_getglobal(L, name);                     /* Stack: Global Env */
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		return;
+	}
+	lua_pushvalue(L, -2);                       /* Stack: Env Global Env */
+	lua_pushinteger(L, env_arg);
+	lua_pushcclosure(L, f, 3);                  /* Stack: Closure Env */
+	lua_setfield(L, -2, name);
+}
+
+/* Gives the environment on top of the stack its own loaders. */
+static void
+bind_env_functions(lua_State *L)
+{
+#if LUA_VERSION_NUM >= 502
+	bind_env_function(L, "load", env_load, 4);
+	bind_env_function(L, "loadfile", env_load, 3);
+#else
+	bind_env_function(L, "load", env_load, 0);
+	bind_env_function(L, "loadfile", env_load, 0);
+	bind_env_function(L, "getfenv", env_getfenv, 0);
+#endif
+	bind_env_function(L, "loadstring", env_load, 0);
+	lua_pushvalue(L, -1);
+	lua_pushcclosure(L, env_dofile, 1);
+	lua_setfield(L, -2, "dofile");
+}
+
 static void
 stop_lua()
 {
@@ -479,36 +919,128 @@ stop_lua()
 #endif
 }
 
+#if LUA_VERSION_NUM >= 504
+static int
+resume_thread(lua_State *L, int nargs)
+{
+	int nres;  /* the results are all there is on the stack of a finished task */
+	return lua_resume(L, NULL, nargs, &nres);
+}
+#elif LUA_VERSION_NUM >= 502
+#	define resume_thread(L, nargs) lua_resume(L, NULL, nargs)
+#else
+#	define resume_thread(L, nargs) lua_resume(L, nargs)
+#endif
+
+static struct erl_task *
+new_task(erlang_pid *pid, long tag)
+{
+	struct erl_task *task = (struct erl_task *) calloc(1, sizeof(struct erl_task));
+	struct erl_task **last;
+
+	task->tag = tag;
+	task->pid = *pid;
+	task->L = lua_newthread(EI_LUA_STATE.L);
+	task->ref = luaL_ref(EI_LUA_STATE.L, LUA_REGISTRYINDEX);
+	task->state = TASK_RUNNING;
+	for (last = &EI_LUA_STATE.tasks; *last != NULL; last = &(*last)->next)
+		;
+	*last = task;
+	return task;
+}
+
 static void
-execute_code(lua_State *L, ei_x_buff *x_out, char *code)
+free_task(struct erl_task *task)
 {
-	int n, i;
+	struct erl_task **t;
 
-	if (luaL_dostring(L, code) != 0) {
-		print("WARNING: %s.", lua_tostring(L, -1));
-		set_error_msg(x_out, lua_tostring(L, -1));
-		lua_pop(L, 1);
-		return;
+	for (t = &EI_LUA_STATE.tasks; *t != NULL; t = &(*t)->next) {
+		if (*t == task) {
+			*t = task->next;
+			break;
+		}
 	}
-	n = lua_gettop(L);
-	if (n == 0) {
-		ei_x_encode_atom(x_out, "ok");
-	} else {
-		for (i = 1; i <= n; i++) {
-			ei_x_encode_list_header(x_out, 1);
-			lua_to_erlang(L, x_out, i);
+	release_datasets(task);
+	luaL_unref(EI_LUA_STATE.L, LUA_REGISTRYINDEX, task->ref);
+	free(task);
+}
+
+static struct erl_task *
+find_task(lua_State *L)
+{
+	struct erl_task *task;
+
+	for (task = EI_LUA_STATE.tasks; task != NULL; task = task->next) {
+		if (task->L == L)
+			return task;
+	}
+	return NULL;
+}
+
+/* Moves a task to the back of the list, so that ready tasks take turns. */
+static void
+requeue_task(struct erl_task *task)
+{
+	struct erl_task **t;
+
+	for (t = &EI_LUA_STATE.tasks; *t != NULL; t = &(*t)->next) {
+		if (*t == task) {
+			*t = task->next;
+			break;
 		}
-		ei_x_encode_empty_list(x_out);
-		lua_pop(L, n);
 	}
+	for (t = &EI_LUA_STATE.tasks; *t != NULL; t = &(*t)->next)
+		;
+	task->next = NULL;
+	*t = task;
 }
 
 static void
-execute_call(lua_State *L, ei_x_buff *x_in, ei_x_buff *x_out, char *fun, int arity, unsigned char *args_str)
+task_error(struct erl_task *task, const char *reason)
+{
+	print("WARNING: %s.", reason);
+	set_error_msg(&EI_LUA_STATE.x_out, task->tag, reason);
+	send_msg(&task->pid, &EI_LUA_STATE.x_out);
+	EI_LUA_STATE.x_out.index = 0;
+	free_task(task);
+}
+
+/* Pushes the compiled code onto the task's stack; returns the number of arguments, or -1 on error. */
+static int
+start_exec(struct erl_task *task, char *code, const char *env)
+{
+	lua_State *L = task->L;
+
+	if (luaL_loadstring(L, code) != 0) {
+		task_error(task, lua_tostring(L, -1));
+		return -1;
+	}
+	if (env != NULL) {
+		push_env(L, env);
+		set_chunk_env(L, -2);
+	}
+	return 0;
+}
+
+/* Pushes the function and its arguments onto the task's stack; returns the number of arguments, or -1 on error. */
+static int
+start_call(struct erl_task *task, ei_x_buff *x_in, char *fun, int arity, unsigned char *args_str, const char *env)
 {
-	int n, i;
+	lua_State *L = task->L;
+	int i;
 
-	lua_getglobal(L, fun);
+	if (! lua_checkstack(L, arity + 2)) {
+		print("WARNING: Insufficient Lua Stack space (could not reserve %d slots).", arity + 2);
+		task_error(task, "Insufficient Lua Stack space");
+		return -1;
+	}
+	if (env != NULL) {
+		push_env(L, env);
+		lua_getfield(L, -1, fun);
+		lua_remove(L, -2);
+	} else {
+		lua_getglobal(L, fun);
+	}
 	if (args_str) {
 		for (i = 0; i < arity; i++) {
 			lua_pushinteger(L, args_str[i]);
@@ -518,13 +1050,41 @@ execute_call(lua_State *L, ei_x_buff *x_in, ei_x_buff *x_out, char *fun, int ari
 			erlang_to_lua(L, x_in, 0);
 		}
 	}
+	return arity;
+}
 
-	if (lua_pcall(L, arity, LUA_MULTRET, 0) != 0) {
-		print("WARNING: %s.", lua_tostring(L, -1));
-		set_error_msg(x_out, lua_tostring(L, -1));
-		lua_pop(L, 1);
+/*
+ * Runs the task until it finishes or is suspended.  A task that
+ * finishes, or fails, sends its reply and is freed.  A suspended task
+ * is either waiting for an erl_rpc reply, or, if it simply yielded,
+ * ready to continue as soon as the Lua Node has nothing else to do.
+ */
+static void
+resume_task(struct erl_task *task, int nargs)
+{
+	lua_State *L = task->L;
+	ei_x_buff *x_out = &EI_LUA_STATE.x_out;
+	struct erl_task *running = EI_LUA_STATE.running;
+	int status, n, i;
+
+	task->state = TASK_RUNNING;
+	EI_LUA_STATE.running = task;
+	status = resume_thread(L, nargs);
+	EI_LUA_STATE.running = running;
+	if (status == LUA_YIELD) {
+		if (task->state == TASK_RUNNING) {
+			task->state = TASK_READY;
+			requeue_task(task);
+		}
 		return;
 	}
+	if (status != 0) {
+		task_error(task, lua_tostring(L, -1));
+		return;
+	}
+	begin_reply(x_out, task->tag);
+	ei_x_encode_tuple_header(x_out, 2);
+	ei_x_encode_atom(x_out, "lua");
 	n = lua_gettop(L);
 	if (n == 0) {
 		ei_x_encode_atom(x_out, "ok");
@@ -534,8 +1094,10 @@ execute_call(lua_State *L, ei_x_buff *x_in, ei_x_buff *x_out, char *fun, int ari
 			lua_to_erlang(L, x_out, i);
 		}
 		ei_x_encode_empty_list(x_out);
-		lua_pop(L, n);
 	}
+	send_msg(&task->pid, x_out);
+	x_out->index = 0;
+	free_task(task);
 }
 
 
@@ -559,13 +1121,22 @@ lua_to_erlang(lua_State *L, ei_x_buff *x_buff, int i)
 	switch (lua_type(L, i)) {
 	case LUA_TNIL:
 		ei_x_encode_atom(x_buff, "nil"); break;
-	case LUA_TNUMBER:
-		if (lua_tointeger(L, i) == lua_tonumber(L, i)) {
-			ei_x_encode_long(x_buff, lua_tointeger(L, i));
+	case LUA_TNUMBER: {
+		lua_Number d;
+#if LUA_VERSION_NUM >= 503
+		if (lua_isinteger(L, i)) {
+			ei_x_encode_longlong(x_buff, (EI_LONGLONG) lua_tointeger(L, i));
+			break;
+		}
+#endif
+		d = lua_tonumber(L, i);
+		if (d == floor(d) && d >= -9223372036854775808.0 && d < 9223372036854775808.0) {
+			ei_x_encode_longlong(x_buff, (EI_LONGLONG) d);
 		} else {
-			ei_x_encode_double(x_buff, lua_tonumber(L, i));
+			ei_x_encode_double(x_buff, d);
 		}
 		break;
+	}
 	case LUA_TBOOLEAN:
 		ei_x_encode_boolean(x_buff, lua_toboolean(L, i)); break;
 	case LUA_TSTRING: {
@@ -618,7 +1189,9 @@ lua_to_erlang(lua_State *L, ei_x_buff *x_buff, int i)
 	case LUA_TFUNCTION:
 		ei_x_encode_atom(x_buff, "function"); break;
 	case LUA_TUSERDATA:
-		ei_x_encode_atom(x_buff, "userdata"); break;
+		if (! erl_array_to_erlang(L, x_buff, i) && ! erl_encoded_to_erlang(L, x_buff, i))
+			ei_x_encode_atom(x_buff, "userdata");
+		break;
 	case LUA_TTHREAD:
 		ei_x_encode_atom(x_buff, "thread"); break;
 	case LUA_TLIGHTUSERDATA:
@@ -649,37 +1222,125 @@ encode_key(lua_State *L, ei_x_buff *x_buff, int i)
 
 
 
+/*
+ * Waits for the reply to an erl_rpc made outside of a task, where the
+ * caller cannot be suspended.  Any other message arriving meanwhile is
+ * put aside for the main message loop.
+ */
 static int
-lerl_rpc(lua_State *L)
+wait_rpc_reply(lua_State *L, long tag)
 {
-	ei_x_buff *x_rpc_in = &EI_LUA_STATE.x_rpc_in;
 	ei_x_buff *x_rpc_out = &EI_LUA_STATE.x_rpc_out;
-	int n = lua_gettop(L);    /* number of arguments */
-	const char *mod, *fun;
+	erlang_msg msg;
 
-	x_rpc_in->index = 0;
-	if (n < 1) {
-		mod = "erlang";
-		fun = "is_alive";
-	} else if (n < 2) {
-		mod = "erlang";
-		fun = luaL_checkstring(L, 1);
-	} else {
-		int i;
-		mod = luaL_checkstring(L, 1);
-		fun = luaL_checkstring(L, 2);
-		for (i = 3; i <= n; i++) {
-			ei_x_encode_list_header(x_rpc_in, 1);
-			lua_to_erlang(L, x_rpc_in, i);
+	for (;;) {
+		x_rpc_out->index = 0;
+		switch (ei_xreceive_msg(EI_LUA_STATE.fd, &msg, x_rpc_out)) {
+		case ERL_TICK:
+			break;
+		case ERL_MSG:
+			if (msg.msgtype == ERL_UNLINK || msg.msgtype == ERL_EXIT) {
+				EI_LUA_STATE.unlinked = 1;
+				return 0;
+			}
+			if (msg.msgtype == ERL_SEND || msg.msgtype == ERL_REG_SEND) {
+				char atom[MAXATOMLEN+1] = {0};
+				erlang_pid pid;
+				int version, arity;
+				long reply_tag;
+				struct erl_deferred *d, **last;
+
+				x_rpc_out->index = 0;
+				if (ei_decode_version(x_rpc_out->buff, &x_rpc_out->index, &version) == 0
+						&& ei_decode_tuple_header(x_rpc_out->buff, &x_rpc_out->index, &arity) == 0
+						&& arity == 4
+						&& ei_decode_atom(x_rpc_out->buff, &x_rpc_out->index, atom) == 0
+						&& strcmp(atom, "rpc_reply") == 0
+						&& ei_decode_pid(x_rpc_out->buff, &x_rpc_out->index, &pid) == 0
+						&& ei_decode_long(x_rpc_out->buff, &x_rpc_out->index, &reply_tag) == 0
+						&& reply_tag == tag) {
+					erlang_to_lua(L, x_rpc_out, 0);
+					return 1;
+				}
+				/* not ours: keep a copy of the whole message */
+				x_rpc_out->index = 0;
+				ei_decode_version(x_rpc_out->buff, &x_rpc_out->index, &version);
+				ei_skip_term(x_rpc_out->buff, &x_rpc_out->index);
+				d = (struct erl_deferred *) calloc(1, sizeof(struct erl_deferred));
+				ei_x_new(&d->x);
+				ei_x_append_buf(&d->x, x_rpc_out->buff, x_rpc_out->index);
+				for (last = &EI_LUA_STATE.deferred; *last != NULL; last = &(*last)->next)
+					;
+				*last = d;
+			}
+			break;
+		case ERL_ERROR:
+		default:
+			return 0;
 		}
 	}
-	ei_x_encode_empty_list(x_rpc_in);
-	/* the casts to char* are OK here, because EI actually makes them const again, sigh */
-	if (ei_rpc(&EI_LUA_STATE.ec, EI_LUA_STATE.fd, (char *) mod, (char *) fun,
-			x_rpc_in->buff, x_rpc_in->index, x_rpc_out) < 0) {
-		print("Warning: erl_rpc(%s, %s, ...) call error: %s (%d).",
-			mod, fun, strerror(erl_errno), erl_errno);
-		lua_pushfstring(L, "erl_rpc(%s, %s, ...) call error: %s (%d).",
+}
+
+/*
+ * Whether the running task can be suspended here.  Short of
+ * lua_isyieldable(), any C function between the caller and the base of
+ * the task (pcall(), table.sort(), ...) is taken to prevent it.  With
+ * Lua 5.1 and LuaJIT, so does any function that was not called by a
+ * plain call from Lua code, such as a metamethod or a for iterator, as
+ * lua_yield() raises an error there.  Such a function gets no name from
+ * lua_getinfo(), or one for a metamethod or iterator; so do some plain
+ * calls, which then merely wait for their rpc replies on the spot.
+ */
+static int
+task_can_yield(lua_State *L)
+{
+#if LUA_VERSION_NUM >= 503
+	return lua_isyieldable(L);
+#else
+	lua_Debug ar;
+#if LUA_VERSION_NUM < 502
+	lua_Debug caller;
+#endif
+	int level;
+
+	for (level = 0; lua_getstack(L, level, &ar); level++) {  /* level 0 is ourselves */
+		lua_getinfo(L, "Sn", &ar);
+		if (level > 0 && strcmp(ar.what, "C") == 0)
+			return 0;
+#if LUA_VERSION_NUM < 502
+		if (! lua_getstack(L, level + 1, &caller))
+			break;  /* the base of the task, started by lua_resume() */
+		if (ar.namewhat[0] == '\0'
+				|| strcmp(ar.namewhat, "metamethod") == 0
+				|| strcmp(ar.namewhat, "for iterator") == 0
+				|| (ar.name != NULL && strncmp(ar.name, "(for ", 5) == 0))
+			return 0;
+#endif
+	}
+	return 1;
+#endif
+}
+
+/* An erl_rpc through the rex server of the Erlang node, waiting for its reply on the spot. */
+static int
+direct_rpc(lua_State *L, const char *mod, const char *fun, int n)
+{
+	ei_x_buff *x_rpc_in = &EI_LUA_STATE.x_rpc_in;
+	ei_x_buff *x_rpc_out = &EI_LUA_STATE.x_rpc_out;
+	int i;
+
+	x_rpc_in->index = 0;
+	for (i = 3; i <= n; i++) {
+		ei_x_encode_list_header(x_rpc_in, 1);
+		lua_to_erlang(L, x_rpc_in, i);
+	}
+	ei_x_encode_empty_list(x_rpc_in);
+	/* the casts to char* are OK here, because EI actually makes them const again, sigh */
+	if (ei_rpc(&EI_LUA_STATE.ec, EI_LUA_STATE.fd, (char *) mod, (char *) fun,
+			x_rpc_in->buff, x_rpc_in->index, x_rpc_out) < 0) {
+		print("Warning: erl_rpc(%s, %s, ...) call error: %s (%d).",
+			mod, fun, strerror(erl_errno), erl_errno);
+		lua_pushfstring(L, "erl_rpc(%s, %s, ...) call error: %s (%d).",
 			mod, fun, strerror(erl_errno), erl_errno);
 		lua_error(L);
 	}
@@ -688,11 +1349,122 @@ lerl_rpc(lua_State *L)
 	return 1;
 }
 
+/*
+ * For a tagged request, the Erlang process that sent it makes the call
+ * on our behalf: we send it { rpc, Tag, Mod, Fun, Args } and it answers
+ * with { rpc_reply, Pid, Tag, Result }.  Called from the task itself,
+ * erl_rpc suspends the task until the answer comes back through the
+ * main message loop; where that is not possible (a coroutine of the
+ * script's own, or inside pcall(), say), it waits for the answer on the
+ * spot.  Untagged requests come from clients that know nothing of this,
+ * so they, and code run outside of any request, make the call directly.
+ */
+static int
+lerl_rpc(lua_State *L)
+{
+	ei_x_buff *x_rpc_in = &EI_LUA_STATE.x_rpc_in;
+	struct erl_task *running = EI_LUA_STATE.running;
+	struct erl_task *task = find_task(L);
+	int n = lua_gettop(L);    /* number of arguments */
+	const char *mod, *fun;
+	int i;
+
+	if (n < 1) {
+		mod = "erlang";
+		fun = "is_alive";
+	} else if (n < 2) {
+		mod = "erlang";
+		fun = luaL_checkstring(L, 1);
+	} else {
+		mod = luaL_checkstring(L, 1);
+		fun = luaL_checkstring(L, 2);
+	}
+	if (running == NULL || running->tag < 0)
+		return direct_rpc(L, mod, fun, n);
+	if (task != running || ! task_can_yield(L))
+		task = NULL;
+	x_rpc_in->index = 0;
+	ei_x_encode_version(x_rpc_in);
+	ei_x_encode_tuple_header(x_rpc_in, 5);
+	ei_x_encode_atom(x_rpc_in, "rpc");
+	ei_x_encode_long(x_rpc_in, running->tag);
+	ei_x_encode_atom(x_rpc_in, mod);
+	ei_x_encode_atom(x_rpc_in, fun);
+	for (i = 3; i <= n; i++) {
+		ei_x_encode_list_header(x_rpc_in, 1);
+		lua_to_erlang(L, x_rpc_in, i);
+	}
+	ei_x_encode_empty_list(x_rpc_in);
+
+	if (task != NULL) {
+#if LUA_VERSION_NUM >= 502
+		task->state = TASK_WAITING;
+		send_msg(&task->pid, x_rpc_in);
+		return lua_yield(L, 0);
+#else
+		/* lua_yield() only marks the coroutine, so the rpc can still be sent after it */
+		int r = lua_yield(L, 0);
+		task->state = TASK_WAITING;
+		send_msg(&task->pid, x_rpc_in);
+		return r;
+#endif
+	}
+	send_msg(&running->pid, x_rpc_in);
+	if (! wait_rpc_reply(L, running->tag)) {
+		print("Warning: erl_rpc(%s, %s, ...) call error: %s (%d).",
+			mod, fun, strerror(erl_errno), erl_errno);
+		lua_pushfstring(L, "erl_rpc(%s, %s, ...) call error: %s (%d).",
+			mod, fun, strerror(erl_errno), erl_errno);
+		lua_error(L);
+	}
+	return 1;
+}
+
+/* Lets other requests run; a no-op where the task cannot be suspended. */
+static int
+lerl_yield(lua_State *L)
+{
+	if (find_task(L) == NULL || ! task_can_yield(L))
+		return 0;
+	return lua_yield(L, 0);
+}
+
+
+/*
+ * Integers too big for a long.  They are exact as long as they fit in
+ * 64 bits and Lua has integers to hold them; anything larger becomes
+ * the nearest float, or nil beyond the range of floats.
+ */
+static void
+push_big(lua_State *L, ei_x_buff *x_buff)
+{
+	int index = x_buff->index;
+	int type, size;
+	EI_LONGLONG ll;
+	erlang_big *big;
+	double d;
+
+	if (ei_decode_longlong(x_buff->buff, &x_buff->index, &ll) == 0) {
+		push_int64(L, (int64_t) ll);
+		return;
+	}
+	ei_get_type(x_buff->buff, &index, &type, &size);
+	big = ei_alloc_big(size);
+	if (big != NULL && ei_decode_big(x_buff->buff, &x_buff->index, big) == 0 && ei_big_to_double(big, &d) == 0)
+		lua_pushnumber(L, d);
+	else
+		lua_pushnil(L);
+	if (big != NULL)
+		ei_free_big(big);
+	x_buff->index = index;
+	ei_skip_term(x_buff->buff, &x_buff->index);
+}
 
 static int
 erlang_to_lua(lua_State *L, ei_x_buff *x_buff, int in_list)
 {
 	ei_term term;
+	int decoded;
 
 	if (ei_tracelevel > 0) {
 		char *s = (char *) calloc(BUFSIZ, sizeof(char));
@@ -703,7 +1475,8 @@ erlang_to_lua(lua_State *L, ei_x_buff *x_buff, int in_list)
 		free(s);
 	}
 
-	if (ei_decode_ei_term(x_buff->buff, &x_buff->index, &term) < 0) {
+	/* decoded is 0 when the term does not fit in an ei_term; nothing is consumed then */
+	if ((decoded = ei_decode_ei_term(x_buff->buff, &x_buff->index, &term)) < 0) {
 		print("Warning: erlang_to_lua() value error (unable to decode value).");
 		lua_pushstring(L, "erlang_to_lua() value error (unable to decode value).");
 		lua_error(L);
@@ -724,7 +1497,14 @@ erlang_to_lua(lua_State *L, ei_x_buff *x_buff, int in_list)
 			break;
 		case ERL_SMALL_INTEGER_EXT:
 		case ERL_INTEGER_EXT:
-			lua_pushnumber(L, term.value.i_val);
+			push_int64(L, term.value.i_val);
+			break;
+		case ERL_SMALL_BIG_EXT:
+		case ERL_LARGE_BIG_EXT:
+			if (decoded)
+				push_int64(L, term.value.i_val);
+			else
+				push_big(L, x_buff);
 			break;
 		case ERL_FLOAT_EXT:
 		case NEW_FLOAT_EXT:
@@ -767,6 +1547,9 @@ erlang_to_lua(lua_State *L, ei_x_buff *x_buff, int in_list)
 						erlang_to_lua(L, x_buff, 0);  /* Stack: Value Table */
 						lua_rawseti(L, -2, 2);        /* Stack: Table */
 					}
+				} else if (term.arity == 3 && is_erl_array_term(x_buff)) {
+					if (ei_tracelevel > 0) print("Debug: erlang_to_lua: erl_array.");
+					erlang_to_erl_array(L, x_buff);
 				} else {
 					int i;
 					if (ei_tracelevel > 0) print("Debug: erlang_to_lua: %d-tuple.", term.arity);
@@ -798,9 +1581,869 @@ erlang_to_lua(lua_State *L, ei_x_buff *x_buff, int in_list)
 			lua_newtable(L);
 			break;
 		default:
+			if (! decoded)
+				ei_skip_term(x_buff->buff, &x_buff->index);
 			lua_pushnil(L);
 			break;
 		}
 	}
 	return 1;
 }
+
+
+/*
+ * Packed numeric arrays.  An erl_array userdata holds its elements as
+ * a flat C array of doubles (f64), or 32 or 64 bit integers (i32, i64),
+ * and crosses to and from Erlang as the raw bytes of a binary.  Bulk
+ * operations are plain loops over that array, written so the compiler
+ * can vectorize them.
+ *
+ * From Lua:
+ *	erl_array(type, n)       -- n zeroes
+ *	erl_array(type, string)  -- packed elements in native byte order
+ *	erl_array(type, table)   -- elements of the array part of table
+ *	#a, a[i], a[i] = v
+ *	a:type(), a:sum(), a:dot(b), a:scale(k), a:min(), a:max()
+ */
+
+#define ERL_ARRAY "erl_array"
+
+enum { ERL_ARRAY_F64, ERL_ARRAY_I32, ERL_ARRAY_I64 };
+static const char *const erl_array_types[] = { "f64", "i32", "i64", NULL };
+static const size_t erl_array_sizes[] = { sizeof(double), sizeof(int32_t), sizeof(int64_t) };
+
+typedef struct {
+	int type;
+	size_t n;
+	union {
+		void *raw;
+		double *f64;
+		int32_t *i32;
+		int64_t *i64;
+	} data;  /* points just past the header, into the same userdata block */
+} erl_array;
+
+/* The most elements an array of the type can have without its size overflowing. */
+#define ERL_ARRAY_MAX(type) ((SIZE_MAX - sizeof(erl_array)) / erl_array_sizes[type])
+
+/* Before Lua 5.3, numbers may not hold every 64 bit integer exactly. */
+static void
+push_int64(lua_State *L, int64_t v)
+{
+#if LUA_VERSION_NUM >= 503
+	lua_pushinteger(L, (lua_Integer) v);
+#else
+	lua_pushnumber(L, (lua_Number) v);
+#endif
+}
+
+/* As luaL_checkinteger() does with Lua 5.3, refuses numbers that are not integers. */
+static int64_t
+check_int64(lua_State *L, int i)
+{
+#if LUA_VERSION_NUM >= 503
+	return (int64_t) luaL_checkinteger(L, i);
+#else
+	lua_Number d = luaL_checknumber(L, i);
+	luaL_argcheck(L, d == floor(d) && d >= -9223372036854775808.0 && d < 9223372036854775808.0,
+		i, "number has no integer representation");
+	return (int64_t) d;
+#endif
+}
+
+static erl_array *
+new_erl_array(lua_State *L, int type, size_t n)
+{
+	erl_array *a = (erl_array *) lua_newuserdata(L, sizeof(erl_array) + n * erl_array_sizes[type]);
+	a->type = type;
+	a->n = n;
+	a->data.raw = (void *) (a + 1);
+	luaL_getmetatable(L, ERL_ARRAY);
+	lua_setmetatable(L, -2);
+	return a;
+}
+
+/* Like luaL_checkudata(), but returns NULL rather than raising an error. */
+static void *
+test_udata(lua_State *L, int i, const char *tname)
+{
+	void *p = lua_touserdata(L, i);
+	int r = 0;
+
+	if (p != NULL && lua_getmetatable(L, i)) {
+		luaL_getmetatable(L, tname);
+		r = lua_rawequal(L, -1, -2);
+		lua_pop(L, 2);
+	}
+	return r ? p : NULL;
+}
+
+static erl_array *
+to_erl_array(lua_State *L, int i)
+{
+	return (erl_array *) test_udata(L, i, ERL_ARRAY);
+}
+
+static erl_array *
+check_erl_array(lua_State *L, int i)
+{
+	return (erl_array *) luaL_checkudata(L, i, ERL_ARRAY);
+}
+
+/*
+ * The loops over the elements, one set per element type.  Sums and dot
+ * products keep four partial results so that floating point additions
+ * need not be done strictly in order.  Integers are worked on as
+ * unsigned, ACC, so that they wrap around on overflow, as Lua 5.3
+ * integers do, rather than overflow.
+ */
+#define ERL_ARRAY_LOOPS(NAME, T, ACC) \
+static ACC \
+NAME##_sum(const T *x, size_t n) \
+{ \
+	ACC s0 = 0, s1 = 0, s2 = 0, s3 = 0; \
+	size_t i; \
+	for (i = 0; i + 4 <= n; i += 4) { \
+		s0 += x[i]; s1 += x[i+1]; s2 += x[i+2]; s3 += x[i+3]; \
+	} \
+	for (; i < n; i++) \
+		s0 += x[i]; \
+	return (s0 + s1) + (s2 + s3); \
+} \
+static ACC \
+NAME##_dot(const T *x, const T *y, size_t n) \
+{ \
+	ACC s0 = 0, s1 = 0, s2 = 0, s3 = 0; \
+	size_t i; \
+	for (i = 0; i + 4 <= n; i += 4) { \
+		s0 += (ACC) x[i] * y[i]; s1 += (ACC) x[i+1] * y[i+1]; \
+		s2 += (ACC) x[i+2] * y[i+2]; s3 += (ACC) x[i+3] * y[i+3]; \
+	} \
+	for (; i < n; i++) \
+		s0 += (ACC) x[i] * y[i]; \
+	return (s0 + s1) + (s2 + s3); \
+} \
+static void \
+NAME##_scale(T *x, size_t n, ACC k) \
+{ \
+	size_t i; \
+	for (i = 0; i < n; i++) \
+		x[i] = (T) (x[i] * k); \
+} \
+static T \
+NAME##_min(const T *x, size_t n) \
+{ \
+	T m = x[0]; \
+	size_t i; \
+	for (i = 1; i < n; i++) \
+		m = x[i] < m ? x[i] : m; \
+	return m; \
+} \
+static T \
+NAME##_max(const T *x, size_t n) \
+{ \
+	T m = x[0]; \
+	size_t i; \
+	for (i = 1; i < n; i++) \
+		m = x[i] > m ? x[i] : m; \
+	return m; \
+}
+
+ERL_ARRAY_LOOPS(f64, double, double)
+ERL_ARRAY_LOOPS(i32, int32_t, uint64_t)
+ERL_ARRAY_LOOPS(i64, int64_t, uint64_t)
+
+static void
+push_element(lua_State *L, erl_array *a, size_t k)
+{
+	switch (a->type) {
+	case ERL_ARRAY_F64: lua_pushnumber(L, a->data.f64[k]); break;
+	case ERL_ARRAY_I32: lua_pushinteger(L, a->data.i32[k]); break;
+	case ERL_ARRAY_I64: push_int64(L, a->data.i64[k]); break;
+	}
+}
+
+static void
+set_element(lua_State *L, erl_array *a, size_t k, int v)
+{
+	switch (a->type) {
+	case ERL_ARRAY_F64: a->data.f64[k] = luaL_checknumber(L, v); break;
+	case ERL_ARRAY_I32: {
+		int64_t x = check_int64(L, v);
+		luaL_argcheck(L, x >= INT32_MIN && x <= INT32_MAX, v, "value out of range for i32");
+		a->data.i32[k] = (int32_t) x;
+		break;
+	}
+	case ERL_ARRAY_I64: a->data.i64[k] = check_int64(L, v); break;
+	}
+}
+
+static int
+lerl_array(lua_State *L)
+{
+	int type = luaL_checkoption(L, 1, NULL, erl_array_types);
+	size_t size = erl_array_sizes[type];
+	erl_array *a;
+
+	switch (lua_type(L, 2)) {
+	case LUA_TNUMBER: {
+		lua_Integer n = luaL_checkinteger(L, 2);
+		luaL_argcheck(L, n >= 0, 2, "negative size");
+		if ((size_t) n > ERL_ARRAY_MAX(type))
+			return luaL_argerror(L, 2, "size too large");
+		a = new_erl_array(L, type, (size_t) n);
+		memset(a->data.raw, 0, a->n * size);
+		break;
+	}
+	case LUA_TSTRING: {
+		size_t len;
+		const char *s = lua_tolstring(L, 2, &len);
+		luaL_argcheck(L, len % size == 0, 2, "length not a multiple of the element size");
+		a = new_erl_array(L, type, len / size);
+		memcpy(a->data.raw, s, len);
+		break;
+	}
+	case LUA_TTABLE: {
+		size_t k, n = lua_objlen(L, 2);
+		if (n > ERL_ARRAY_MAX(type))
+			return luaL_argerror(L, 2, "size too large");
+		a = new_erl_array(L, type, n);
+		for (k = 0; k < n; k++) {
+			lua_rawgeti(L, 2, (int) k + 1);
+			set_element(L, a, k, -1);
+			lua_pop(L, 1);
+		}
+		break;
+	}
+	default:
+		return luaL_argerror(L, 2, "size, string or table expected");
+	}
+	return 1;
+}
+
+static int
+erl_array_index(lua_State *L)
+{
+	erl_array *a = check_erl_array(L, 1);
+
+	if (lua_type(L, 2) == LUA_TNUMBER) {
+		lua_Integer k = lua_tointeger(L, 2);
+		if (k >= 1 && (size_t) k <= a->n)
+			push_element(L, a, (size_t) k - 1);
+		else
+			lua_pushnil(L);
+	} else {
+		/* method lookup in the metatable */
+		lua_getmetatable(L, 1);
+		lua_pushvalue(L, 2);
+		lua_rawget(L, -2);
+	}
+	return 1;
+}
+
+static int
+erl_array_newindex(lua_State *L)
+{
+	erl_array *a = check_erl_array(L, 1);
+	lua_Integer k = luaL_checkinteger(L, 2);
+
+	luaL_argcheck(L, k >= 1 && (size_t) k <= a->n, 2, "index out of range");
+	set_element(L, a, (size_t) k - 1, 3);
+	return 0;
+}
+
+static int
+erl_array_len(lua_State *L)
+{
+	erl_array *a = check_erl_array(L, 1);
+	lua_pushinteger(L, (lua_Integer) a->n);
+	return 1;
+}
+
+static int
+erl_array_tostring(lua_State *L)
+{
+	erl_array *a = check_erl_array(L, 1);
+	lua_pushfstring(L, "erl_array(%s, %d): %p", erl_array_types[a->type], (int) a->n, (void *) a);
+	return 1;
+}
+
+static int
+erl_array_type(lua_State *L)
+{
+	erl_array *a = check_erl_array(L, 1);
+	lua_pushstring(L, erl_array_types[a->type]);
+	return 1;
+}
+
+static int
+erl_array_sum(lua_State *L)
+{
+	erl_array *a = check_erl_array(L, 1);
+
+	switch (a->type) {
+	case ERL_ARRAY_F64: lua_pushnumber(L, f64_sum(a->data.f64, a->n)); break;
+	case ERL_ARRAY_I32: push_int64(L, (int64_t) i32_sum(a->data.i32, a->n)); break;
+	case ERL_ARRAY_I64: push_int64(L, (int64_t) i64_sum(a->data.i64, a->n)); break;
+	}
+	return 1;
+}
+
+static int
+erl_array_dot(lua_State *L)
+{
+	erl_array *a = check_erl_array(L, 1);
+	erl_array *b = check_erl_array(L, 2);
+
+	luaL_argcheck(L, a->type == b->type, 2, "element types differ");
+	luaL_argcheck(L, a->n == b->n, 2, "lengths differ");
+	switch (a->type) {
+	case ERL_ARRAY_F64: lua_pushnumber(L, f64_dot(a->data.f64, b->data.f64, a->n)); break;
+	case ERL_ARRAY_I32: push_int64(L, (int64_t) i32_dot(a->data.i32, b->data.i32, a->n)); break;
+	case ERL_ARRAY_I64: push_int64(L, (int64_t) i64_dot(a->data.i64, b->data.i64, a->n)); break;
+	}
+	return 1;
+}
+
+/* Scales in place, and returns the array itself; integer arrays take integer factors only. */
+static int
+erl_array_scale(lua_State *L)
+{
+	erl_array *a = check_erl_array(L, 1);
+
+	switch (a->type) {
+	case ERL_ARRAY_F64: f64_scale(a->data.f64, a->n, luaL_checknumber(L, 2)); break;
+	case ERL_ARRAY_I32: i32_scale(a->data.i32, a->n, (uint64_t) check_int64(L, 2)); break;
+	case ERL_ARRAY_I64: i64_scale(a->data.i64, a->n, (uint64_t) check_int64(L, 2)); break;
+	}
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int
+erl_array_min(lua_State *L)
+{
+	erl_array *a = check_erl_array(L, 1);
+
+	if (a->n == 0)
+		lua_pushnil(L);
+	else switch (a->type) {
+	case ERL_ARRAY_F64: lua_pushnumber(L, f64_min(a->data.f64, a->n)); break;
+	case ERL_ARRAY_I32: lua_pushinteger(L, i32_min(a->data.i32, a->n)); break;
+	case ERL_ARRAY_I64: push_int64(L, i64_min(a->data.i64, a->n)); break;
+	}
+	return 1;
+}
+
+static int
+erl_array_max(lua_State *L)
+{
+	erl_array *a = check_erl_array(L, 1);
+
+	if (a->n == 0)
+		lua_pushnil(L);
+	else switch (a->type) {
+	case ERL_ARRAY_F64: lua_pushnumber(L, f64_max(a->data.f64, a->n)); break;
+	case ERL_ARRAY_I32: lua_pushinteger(L, i32_max(a->data.i32, a->n)); break;
+	case ERL_ARRAY_I64: push_int64(L, i64_max(a->data.i64, a->n)); break;
+	}
+	return 1;
+}
+
+static const luaL_Reg erl_array_meta[] = {
+	{ "__index", erl_array_index },
+	{ "__newindex", erl_array_newindex },
+	{ "__len", erl_array_len },
+	{ "__tostring", erl_array_tostring },
+	{ "type", erl_array_type },
+	{ "sum", erl_array_sum },
+	{ "dot", erl_array_dot },
+	{ "scale", erl_array_scale },
+	{ "min", erl_array_min },
+	{ "max", erl_array_max },
+	{ NULL, NULL }
+};
+
+static void
+open_erl_array(lua_State *L)
+{
+	const luaL_Reg *r;
+
+	luaL_newmetatable(L, ERL_ARRAY);
+	for (r = erl_array_meta; r->name != NULL; r++) {
+		lua_pushcfunction(L, r->func);
+		lua_setfield(L, -2, r->name);
+	}
+	lua_pop(L, 1);
+	lua_register(L, "erl_array", lerl_array);
+}
+
+static int
+erl_array_to_erlang(lua_State *L, ei_x_buff *x_buff, int i)
+{
+	erl_array *a = to_erl_array(L, i);
+
+	if (a == NULL)
+		return 0;
+	ei_x_encode_binary(x_buff, a->data.raw, (long) (a->n * erl_array_sizes[a->type]));
+	return 1;
+}
+
+/* Tests, without consuming anything, whether a tuple's elements start with the atom erl_array. */
+static int
+is_erl_array_term(ei_x_buff *x_buff)
+{
+	char tag[MAXATOMLEN+1] = {0};
+	int index = x_buff->index;
+
+	return ei_decode_atom(x_buff->buff, &index, tag) == 0 && strcmp(tag, ERL_ARRAY) == 0;
+}
+
+/*
+ * Decodes the remainder of an { erl_array, Type, Binary } tuple.  The
+ * binary is decoded straight into the userdata; a malformed term
+ * becomes nil, like other unusable values.
+ */
+static void
+erlang_to_erl_array(lua_State *L, ei_x_buff *x_buff)
+{
+	char type_name[MAXATOMLEN+1] = {0};
+	int type, ei_type, size;
+	long len;
+	erl_array *a;
+
+	ei_skip_term(x_buff->buff, &x_buff->index);  /* the erl_array tag */
+	if (ei_decode_atom(x_buff->buff, &x_buff->index, type_name) < 0) {
+		ei_skip_term(x_buff->buff, &x_buff->index);
+	} else {
+		for (type = 0; erl_array_types[type] != NULL; type++) {
+			if (strcmp(type_name, erl_array_types[type]) == 0)
+				break;
+		}
+		if (erl_array_types[type] != NULL
+				&& ei_get_type(x_buff->buff, &x_buff->index, &ei_type, &size) == 0
+				&& ei_type == ERL_BINARY_EXT
+				&& size % erl_array_sizes[type] == 0
+				&& (size_t) size / erl_array_sizes[type] <= ERL_ARRAY_MAX(type)) {
+			a = new_erl_array(L, type, size / erl_array_sizes[type]);
+			ei_decode_binary(x_buff->buff, &x_buff->index, a->data.raw, &len);
+			return;
+		}
+	}
+	print("Warning: erlang_to_lua() value error (malformed erl_array).");
+	ei_skip_term(x_buff->buff, &x_buff->index);
+	lua_pushnil(L);
+}
+
+
+/*
+ * An erl_encoded userdata holds a Lua value already translated to the
+ * Erlang external term format.  lua_to_erlang() copies its bytes as
+ * they are, so a large constant table that is returned over and over
+ * is only walked and encoded once:
+ *	local config = erl_encoded{ ... }
+ *	function get_config() return config end
+ * The bytes are a snapshot; later changes to the table are not seen.
+ *	#e is the number of bytes
+ */
+
+#define ERL_ENCODED "erl_encoded"
+
+typedef struct {
+	long len;
+	char *bytes;  /* points just past the header, into the same userdata block */
+} erl_encoded;
+
+static int
+lerl_encoded(lua_State *L)
+{
+	ei_x_buff x;
+	erl_encoded *e;
+
+	luaL_checkany(L, 1);
+	lua_settop(L, 1);
+	ei_x_new(&x);
+	lua_to_erlang(L, &x, 1);
+	e = (erl_encoded *) lua_newuserdata(L, sizeof(erl_encoded) + x.index);
+	e->len = x.index;
+	e->bytes = (char *) (e + 1);
+	memcpy(e->bytes, x.buff, x.index);
+	ei_x_free(&x);
+	luaL_getmetatable(L, ERL_ENCODED);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static int
+erl_encoded_len(lua_State *L)
+{
+	erl_encoded *e = (erl_encoded *) luaL_checkudata(L, 1, ERL_ENCODED);
+	lua_pushinteger(L, e->len);
+	return 1;
+}
+
+static int
+erl_encoded_tostring(lua_State *L)
+{
+	erl_encoded *e = (erl_encoded *) luaL_checkudata(L, 1, ERL_ENCODED);
+	lua_pushfstring(L, "erl_encoded(%d bytes): %p", (int) e->len, (void *) e);
+	return 1;
+}
+
+static void
+open_erl_encoded(lua_State *L)
+{
+	luaL_newmetatable(L, ERL_ENCODED);
+	lua_pushcfunction(L, erl_encoded_len);
+	lua_setfield(L, -2, "__len");
+	lua_pushcfunction(L, erl_encoded_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_pop(L, 1);
+	lua_register(L, "erl_encoded", lerl_encoded);
+}
+
+static int
+erl_encoded_to_erlang(lua_State *L, ei_x_buff *x_buff, int i)
+{
+	erl_encoded *e = (erl_encoded *) test_udata(L, i, ERL_ENCODED);
+
+	if (e == NULL)
+		return 0;
+	ei_x_append_buf(x_buff, e->bytes, (int) e->len);
+	return 1;
+}
+
+
+/*
+ * An erl_dataset is a read only table kept in a file written by
+ * erlang_lua:publish_dataset/2.  The file is mapped into memory rather
+ * than loaded, so all the Lua Nodes on a host share one copy of it, and
+ * a value is only translated to Lua when it is looked up:
+ *	local rates = erl_dataset '/var/lib/rates.elds'
+ *	rates.EUR, rates['GBP'], #rates
+ * Publishing replaces the file, and a Lua Node switches to the new
+ * version the first time a request uses the dataset afterwards.  A
+ * request keeps the version it saw first until it finishes, even while
+ * newer requests already see the next one.
+ *
+ * The file holds, with all numbers 32 bit unsigned big endian:
+ *	"ELDS", format version, number of entries, number of slots (a power of 2),
+ *	for each slot, the offset of an entry, or 0,
+ *	the entries: FNV-1a hash of the key, key length, value length,
+ *		key, value in external term format
+ * An entry sits at the first free slot from its hash (modulo the number
+ * of slots) onwards.
+ *
+ * Not available on Windows.
+ */
+
+#ifdef WINDOWS
+
+static void
+open_erl_dataset(lua_State *L)
+{
+}
+
+static void
+release_datasets(struct erl_task *task)
+{
+}
+
+#else
+
+#define ERL_DATASET "erl_dataset"
+#define ERL_DATASETS "erl_datasets"
+#define ERL_DATASET_VERSION 1
+#define ERL_DATASET_HEADER 16
+
+/* One mapped version of a dataset file. */
+typedef struct {
+	const unsigned char *map;
+	size_t size;
+	uint32_t count;
+	uint32_t slots;
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	int refs;  /* the dataset, while this is its current version, and each task that keeps it */
+} erl_dataset_map;
+
+typedef struct {
+	char *path;  /* points just past the header, into the same userdata block */
+	erl_dataset_map *current;
+} erl_dataset;
+
+/* A version of a dataset that a task keeps until it finishes. */
+struct erl_dataset_pin {
+	erl_dataset *ds;
+	erl_dataset_map *map;
+	struct erl_dataset_pin *next;
+};
+
+static uint32_t
+get_u32(const unsigned char *p)
+{
+	return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | (uint32_t) p[3];
+}
+
+static uint32_t
+fnv1a(const char *s, size_t len)
+{
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char) s[i]) * 16777619u;
+	return h;
+}
+
+static void
+release_dataset_map(erl_dataset_map *m)
+{
+	if (--m->refs == 0) {
+		munmap((void *) m->map, m->size);
+		free(m);
+	}
+}
+
+/* Maps the file as the current version, if it is not that already; returns NULL, or why not. */
+static const char *
+map_dataset(erl_dataset *ds)
+{
+	erl_dataset_map *cur = ds->current, *m;
+	struct stat st;
+	const unsigned char *map;
+	uint32_t slots;
+	int fd;
+
+	if (stat(ds->path, &st) < 0)
+		return strerror(errno);
+	if (cur != NULL && st.st_dev == cur->dev && st.st_ino == cur->ino
+			&& st.st_mtime == cur->mtime && (size_t) st.st_size == cur->size)
+		return NULL;
+	if ((fd = open(ds->path, O_RDONLY)) < 0)
+		return strerror(errno);
+	/* The file may have been replaced since stat(); map the one opened. */
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return strerror(errno);
+	}
+	if ((size_t) st.st_size < ERL_DATASET_HEADER) {
+		close(fd);
+		return "not a dataset";
+	}
+	map = (const unsigned char *) mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == (const unsigned char *) MAP_FAILED)
+		return strerror(errno);
+	slots = get_u32(map + 12);
+	if (memcmp(map, "ELDS", 4) != 0 || get_u32(map + 4) != ERL_DATASET_VERSION
+			|| slots == 0 || (slots & (slots - 1)) != 0
+			|| slots > ((size_t) st.st_size - ERL_DATASET_HEADER) / 4) {
+		munmap((void *) map, (size_t) st.st_size);
+		return "not a dataset";
+	}
+	m = (erl_dataset_map *) malloc(sizeof(erl_dataset_map));
+	m->map = map;
+	m->size = (size_t) st.st_size;
+	m->count = get_u32(map + 8);
+	m->slots = slots;
+	m->dev = st.st_dev;
+	m->ino = st.st_ino;
+	m->mtime = st.st_mtime;
+	m->refs = 1;
+	if (cur != NULL)
+		release_dataset_map(cur);
+	ds->current = m;
+	return NULL;
+}
+
+/*
+ * Returns the version of the dataset the running task sees: the one it
+ * kept when it first used the dataset, or else the newest, which it
+ * keeps from now on.  Outside of a task it is always the newest.
+ */
+static erl_dataset_map *
+dataset_map(erl_dataset *ds)
+{
+	struct erl_task *task = EI_LUA_STATE.running;
+	struct erl_dataset_pin *pin;
+	const char *err;
+
+	if (task != NULL) {
+		for (pin = task->datasets; pin != NULL; pin = pin->next) {
+			if (pin->ds == ds)
+				return pin->map;
+		}
+	}
+	if ((err = map_dataset(ds)) != NULL)
+		print("Warning: erl_dataset(%s) keeps its current version: %s.", ds->path, err);
+	if (task != NULL) {
+		pin = (struct erl_dataset_pin *) malloc(sizeof(struct erl_dataset_pin));
+		pin->ds = ds;
+		pin->map = ds->current;
+		pin->map->refs++;
+		pin->next = task->datasets;
+		task->datasets = pin;
+	}
+	return ds->current;
+}
+
+static void
+release_datasets(struct erl_task *task)
+{
+	struct erl_dataset_pin *pin;
+
+	while ((pin = task->datasets) != NULL) {
+		task->datasets = pin->next;
+		release_dataset_map(pin->map);
+		free(pin);
+	}
+}
+
+static erl_dataset_map *
+check_erl_dataset(lua_State *L, int i)
+{
+	return dataset_map((erl_dataset *) luaL_checkudata(L, i, ERL_DATASET));
+}
+
+static int
+lerl_dataset(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	erl_dataset *ds;
+	const char *err;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, ERL_DATASETS);
+	lua_getfield(L, -1, path);
+	if (! lua_isnil(L, -1)) {
+		check_erl_dataset(L, -1);
+		return 1;
+	}
+	lua_pop(L, 1);
+	ds = (erl_dataset *) lua_newuserdata(L, sizeof(erl_dataset) + strlen(path) + 1);
+	memset(ds, 0, sizeof(erl_dataset));
+	ds->path = (char *) (ds + 1);
+	strcpy(ds->path, path);
+	luaL_getmetatable(L, ERL_DATASET);
+	lua_setmetatable(L, -2);
+	if ((err = map_dataset(ds)) != NULL)
+		return luaL_error(L, "erl_dataset(%s): %s", path, err);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -3, path);
+	check_erl_dataset(L, -1);
+	return 1;
+}
+
+static int
+erl_dataset_index(lua_State *L)
+{
+	erl_dataset_map *m = check_erl_dataset(L, 1);
+	const unsigned char *entry;
+	const char *key;
+	size_t len, off, key_len, val_len;
+	uint32_t hash, slot, i;
+	ei_x_buff x;
+	int version;
+
+	if (lua_type(L, 2) != LUA_TSTRING) {
+		lua_pushnil(L);
+		return 1;
+	}
+	key = lua_tolstring(L, 2, &len);
+	hash = fnv1a(key, len);
+	for (i = 0, slot = hash & (m->slots - 1); i < m->slots; i++, slot = (slot + 1) & (m->slots - 1)) {
+		off = get_u32(m->map + ERL_DATASET_HEADER + 4 * (size_t) slot);
+		if (off == 0 || off > m->size - 12)
+			break;
+		entry = m->map + off;
+		key_len = get_u32(entry + 4);
+		val_len = get_u32(entry + 8);
+		if (key_len > m->size - off - 12 || val_len > m->size - off - 12 - key_len)
+			break;  /* a damaged file */
+		if (get_u32(entry) == hash && key_len == len && memcmp(entry + 12, key, len) == 0) {
+			x.buff = (char *) entry + 12 + key_len;
+			x.buffsz = (int) val_len;
+			x.index = 0;
+			if (ei_decode_version(x.buff, &x.index, &version) < 0)
+				break;
+			erlang_to_lua(L, &x, 0);
+			return 1;
+		}
+	}
+	lua_pushnil(L);
+	return 1;
+}
+
+static int
+erl_dataset_len(lua_State *L)
+{
+	erl_dataset_map *m = check_erl_dataset(L, 1);
+	lua_pushinteger(L, (lua_Integer) m->count);
+	return 1;
+}
+
+static int
+erl_dataset_tostring(lua_State *L)
+{
+	erl_dataset *ds = (erl_dataset *) luaL_checkudata(L, 1, ERL_DATASET);
+	lua_pushfstring(L, "erl_dataset(%s): %p", ds->path, (void *) ds);
+	return 1;
+}
+
+static int
+erl_dataset_gc(lua_State *L)
+{
+	erl_dataset *ds = (erl_dataset *) luaL_checkudata(L, 1, ERL_DATASET);
+	struct erl_task *task;
+	struct erl_dataset_pin **pin, *p;
+
+	/* A task that still keeps a version of the dataset can no longer reach it. */
+	for (task = EI_LUA_STATE.tasks; task != NULL; task = task->next) {
+		for (pin = &task->datasets; *pin != NULL; ) {
+			if ((*pin)->ds == ds) {
+				p = *pin;
+				*pin = p->next;
+				release_dataset_map(p->map);
+				free(p);
+			} else {
+				pin = &(*pin)->next;
+			}
+		}
+	}
+	if (ds->current != NULL)
+		release_dataset_map(ds->current);
+	ds->current = NULL;
+	return 0;
+}
+
+static const luaL_Reg erl_dataset_meta[] = {
+	{ "__index", erl_dataset_index },
+	{ "__len", erl_dataset_len },
+	{ "__tostring", erl_dataset_tostring },
+	{ "__gc", erl_dataset_gc },
+	{ NULL, NULL }
+};
+
+/* Datasets are kept by path in a weak table, so each file is mapped once per Lua Node. */
+static void
+open_erl_dataset(lua_State *L)
+{
+	const luaL_Reg *r;
+
+	luaL_newmetatable(L, ERL_DATASET);
+	for (r = erl_dataset_meta; r->name != NULL; r++) {
+		lua_pushcfunction(L, r->func);
+		lua_setfield(L, -2, r->name);
+	}
+	lua_pop(L, 1);
+	lua_newtable(L);
+	lua_createtable(L, 0, 1);
+	lua_pushstring(L, "v");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
+	lua_setfield(L, LUA_REGISTRYINDEX, ERL_DATASETS);
+	lua_register(L, "erl_dataset", lerl_dataset);
+}
+
+#endif
@@ -2,7 +2,8 @@
 
 -behaviour(gen_server).
 
--export([start_link/1, start_link/2, lua/2, call/3, stop/1]).
+-export([start_link/1, start_link/2, start_link/3, lua/2, lua/3, call/3, call/4, drop_env/2, queue_info/1, memo_info/1, stop/1]).
+-export([array/2, publish_dataset/2]).
 -export([init/1, handle_call/3, handle_cast/2, handle_info/2, code_change/3, terminate/2]).
 
 % logging macros
@@ -22,38 +23,160 @@
 	error_logger:info_report(format_log(
 		[{level, "DEBUG"}, {module, ?MODULE}, {file, ?FILE}, {line, ?LINE}, {function, FUN}], REPORT))).
 
+% dataset file format, see erl_dataset() in lua_enode.c
+-define(DATASET_VERSION, 1).
+-define(DATASET_HEADER, 16).
+
 
 start_link(Id) ->
 	start_link(Id, 0).
 
-start_link(Id, Tracelevel) when Tracelevel >= 0 ->
-	gen_server:start_link({local, Id}, ?MODULE, [Id, Tracelevel], []).
+start_link(Id, Tracelevel) ->
+	start_link(Id, Tracelevel, []).
+
+% Options:
+%	{max_queue, N} - at most N requests wait while the Lua Node is busy;
+%		further requests are shed with {error, busy} (default ?MAX_QUEUE_LENGTH),
+%	{concurrency, N} - up to N requests run on the Lua Node at the same time,
+%		each in a coroutine of its own, taking turns whenever one waits on an
+%		erl_rpc() or calls erl_yield() (default 1),
+%	{memo_size, N} - at most N results of memoized calls are kept (default ?MEMO_SIZE),
+%	{memo_bytes, B} - and they take up at most B bytes in external term
+%		format (default ?MEMO_BYTES); the least recently used go first.
+start_link(Id, Tracelevel, Options) when Tracelevel >= 0, is_list(Options) ->
+	gen_server:start_link({local, Id}, ?MODULE, [Id, Tracelevel, Options], []).
+
+lua(Id, Code) ->
+	lua(Id, Code, []).
+
+% Options:
+%	{timeout, Ms} - give up on the request Ms milliseconds from now,
+%	{deadline, {Mega, Secs, Micro}} - give up on the request at this os:timestamp(),
+%	{priority, high | normal | low} - order in which queued requests are served
+%		(default normal; requests with equal priority are served earliest deadline first),
+%	{env, Env} - run in the named environment Env, an atom, instead of the global one,
+%	memo - call/4 only: the function is pure, so its result for these exact
+%		arguments may be remembered, and answered again without asking Lua.
+% A request whose deadline passes is answered with {error, timeout}; if it has
+% not yet been sent to the Lua Node, it never will be. A request with
+% malformed options is answered with {error, badarg} straight away.
+lua(Id, Code, Options) when is_list(Code) ->
+	lua(Id, list_to_binary(Code), Options);
+lua(Id, Code, Options) when is_binary(Code), is_list(Options) ->
+	case valid_options(Options) of
+		true -> gen_server:call(Id, {exec, Code, Options}, infinity);
+		false -> {error, badarg}
+	end.
+
+call(Id, Fun, Args) ->
+	call(Id, Fun, Args, []).
 
-lua(Id, Code) when is_list(Code) ->
-	gen_server:call(Id, {exec, list_to_binary(Code)}, infinity);
-lua(Id, Code) when is_binary(Code) ->
-	gen_server:call(Id, {exec, Code}, infinity).
+call(Id, Fun, Args, Options) when is_atom(Fun), is_list(Args), is_list(Options) ->
+	case valid_options(Options) of
+		true -> gen_server:call(Id, {call, Fun, Args, Options}, infinity);
+		false -> {error, badarg}
+	end.
 
-call(Id, Fun, Args) when is_atom(Fun), is_list(Args) ->
-	gen_server:call(Id, {call, Fun, Args}, infinity).
+% Returns [{queue_length, N}, {max_queue, M}, {running, R}, {concurrency, C},
+% {busy, Bool}, {expired, E}, {shed, S}], where Bool tells whether new
+% requests have to wait, E counts the requests dropped because their
+% deadline passed, and S the requests turned away because the queue was full.
+queue_info(Id) ->
+	gen_server:call(Id, queue_info, infinity).
+
+% Returns [{entries, N}, {max_entries, M}, {bytes, B}, {max_bytes, MB},
+% {hits, H}, {misses, Mi}] for the results remembered for memo calls.
+% Any lua/2,3 or drop_env/2 request forgets them all, as it may redefine
+% the functions.
+memo_info(Id) ->
+	gen_server:call(Id, memo_info, infinity).
+
+% Discards the named environment and all its globals.
+drop_env(Id, Env) when is_atom(Env) ->
+	gen_server:call(Id, {drop_env, Env, []}, infinity).
 
 stop(Id) ->
 	gen_server:call(Id, stop, infinity).
 
+% Packs numbers into a term that arrives in Lua as an erl_array userdata.
+% Type is f64, i32 or i64; the elements are given as a list of numbers,
+% or as a binary already packed in native byte order.
+array(Type, Bin) when is_binary(Bin) ->
+	{erl_array, Type, Bin};
+array(f64, List) when is_list(List) ->
+	{erl_array, f64, << <<X:64/float-native>> || X <- List >>};
+array(i32, List) when is_list(List) ->
+	{erl_array, i32, << <<X:32/signed-native>> || X <- List >>};
+array(i64, List) when is_list(List) ->
+	{erl_array, i64, << <<X:64/signed-native>> || X <- List >>}.
+
+% Writes the list of {Key, Value} pairs to File, for the Lua Nodes on
+% this host to share through erl_dataset(File): a read only table in
+% which each Value, any term, is looked up by its Key, a binary or an
+% atom. Of duplicate Keys, the first counts. The file is replaced
+% atomically; a Lua Node that has the dataset open switches to the
+% new version with its next request that uses it. A dataset of 4 GiB
+% or more is refused with {error, too_large}.
+publish_dataset(File, KVs) when is_list(KVs) ->
+	Entries = lists:ukeysort(1, [{dataset_key(K), term_to_binary(V)} || {K, V} <- KVs]),
+	Count = length(Entries),
+	Slots = dataset_slots(2 * Count, 1),
+	{Table, Bodies, Size} = lists:foldl(
+		fun ({Key, Value}, {Slot_Table, Acc, Offset}) ->
+			Hash = fnv1a(Key),
+			Body = <<Hash:32, (byte_size(Key)):32, (byte_size(Value)):32, Key/binary, Value/binary>>,
+			{dataset_insert(Hash band (Slots - 1), Offset, Slot_Table), [Body | Acc], Offset + byte_size(Body)}
+		end,
+		{array:new(Slots, {default, 0}), [], ?DATASET_HEADER + 4 * Slots},
+		Entries),
+	case Size > 16#ffffffff of
+		true ->
+			{error, too_large};
+		false ->
+			write_dataset(File, [
+				<<"ELDS", ?DATASET_VERSION:32, Count:32, Slots:32>>,
+				[<<Offset:32>> || Offset <- array:to_list(Table)],
+				lists:reverse(Bodies)
+			])
+	end.
+
 
 % Here follow the gen_server callback functions.
 
+-define(MAX_INFOTEXT_LINES, 1000).
+-define(MAX_QUEUE_LENGTH, 100).
+-define(MEMO_SIZE, 1000).
+-define(MEMO_BYTES, 16 * 1024 * 1024).
+
 -record(state, {
 	id,
 	port,
 	mbox, % The Lua Node gets messages sent to this Mbox.
-	from, % The client where results need to be sent back to.
+	running = gb_trees:empty(), % Requests on the Lua Node: Seq -> {Key, From, Memo, Timer} (From is 'expired' once past its deadline).
+	concurrency = 1, % How many requests may run on the Lua Node at once.
+	queue = gb_trees:empty(), % Waiting requests, keyed by {Priority, Deadline, Seq}: {Request, From, Memo, Timer}.
+	max_queue = ?MAX_QUEUE_LENGTH,
+	seq = 0, % Tie breaker for queue keys; keeps them unique.
+	expired = 0, % Number of requests dropped because their deadline passed.
+	shed = 0, % Number of requests turned away because the queue was full.
+	memo, % Remembered results of memo calls.
 	infotext = [], % Stores up any info text coming from the Lua Node.
 	infoline = [] % Builds up complete lines of info text.
 }).
--define(MAX_INFOTEXT_LINES, 1000).
 
-init([Id, Tracelevel]) ->
+-record(memo, {
+	entries = gb_trees:empty(), % {Fun, Env, term_to_binary(Args)} -> {Stamp, Size, Reply}.
+	lru = gb_trees:empty(), % Stamp -> Key, oldest first.
+	stamp = 0,
+	bytes = 0, % Total Size of the entries.
+	max_entries = ?MEMO_SIZE,
+	max_bytes = ?MEMO_BYTES,
+	generation = 0, % Bumped whenever the entries are forgotten.
+	hits = 0,
+	misses = 0
+}).
+
+init([Id, Tracelevel, Options]) ->
 	process_flag(trap_exit, true),
 	{Clean_Id, Host, Lua_Node_Name} = mk_node_name(Id),
 	Path = case code:priv_dir(erlang_lua) of
@@ -72,7 +195,14 @@ init([Id, Tracelevel]) ->
 		{ok, Cmd} ->
 			?LOG_INFO(init, [{lua_node, Clean_Id}, {start, Cmd}]),
 			Port = open_port({spawn, Cmd}, [stream, {line, 100}, stderr_to_stdout, exit_status]),
-			wait_for_startup(#state{id=Id, port=Port, mbox={lua, Lua_Node_Name}})
+			Max_Queue = proplists:get_value(max_queue, Options, ?MAX_QUEUE_LENGTH),
+			Concurrency = proplists:get_value(concurrency, Options, 1),
+			Memo = #memo{
+				max_entries=proplists:get_value(memo_size, Options, ?MEMO_SIZE),
+				max_bytes=proplists:get_value(memo_bytes, Options, ?MEMO_BYTES)
+			},
+			wait_for_startup(#state{id=Id, port=Port, mbox={lua, Lua_Node_Name},
+					max_queue=Max_Queue, concurrency=Concurrency, memo=Memo})
 	end.
 
 mk_cmdline(Lua, Id, Host, Tracelevel) ->
@@ -104,20 +234,55 @@ wait_for_startup(#state{port=Port} = State) ->
 	end.
 
 
-handle_call({exec, Code}, From, #state{mbox=Mbox, from=undefined} = State) ->
-	?LOG_DEBUG(handle_call, [{exec, Code}, State]),
-	Mbox ! {exec, self(), Code, []},
-	{noreply, State#state{from=From}};
-handle_call({call, Fun, Args}, From, #state{mbox=Mbox, from=undefined} = State) ->
-	?LOG_DEBUG(handle_call, [{call, Fun, Args}, State]),
-	Mbox ! {call, self(), Fun, Args},
-	{noreply, State#state{from=From}};
-handle_call(stop, _From, #state{from=undefined} = State) ->
-	?LOG_DEBUG(handle_call, [stop, State]),
-	{stop, normal, ok, State};
-handle_call(Request, _From, #state{from=Id} = State) when Id =/= undefined ->
-	?LOG_DEBUG(handle_call, [{busy, Request}, State]),
-	{reply, {error, busy}, State}.
+handle_call({exec, Code, Options}, From, State) ->
+	enqueue({exec, Code, env(Options)}, clear, Options, From, State);
+handle_call({call, Fun, Args, Options}, From, #state{memo=Memo} = State) ->
+	Env = env(Options),
+	case proplists:get_bool(memo, Options) of
+		false ->
+			enqueue({call, Fun, Args, Env}, none, Options, From, State);
+		true ->
+			Memo_Key = {Fun, Env, term_to_binary(Args)},
+			case memo_lookup(Memo_Key, Memo) of
+				{hit, Reply, New_Memo} ->
+					{reply, Reply, State#state{memo=New_Memo}};
+				{miss, New_Memo} ->
+					enqueue({call, Fun, Args, Env}, Memo_Key, Options, From, State#state{memo=New_Memo})
+			end
+	end;
+handle_call({drop_env, Env, Options}, From, State) ->
+	enqueue({drop_env, Env}, clear, Options, From, State);
+handle_call(queue_info, _From, #state{queue=Queue, max_queue=Max_Queue, running=Running,
+		concurrency=Concurrency, expired=Expired, shed=Shed} = State) ->
+	Info = [
+		{queue_length, gb_trees:size(Queue)},
+		{max_queue, Max_Queue},
+		{running, gb_trees:size(Running)},
+		{concurrency, Concurrency},
+		{busy, not has_free_slot(State)},
+		{expired, Expired},
+		{shed, Shed}
+	],
+	{reply, Info, State};
+handle_call(memo_info, _From, #state{memo=Memo} = State) ->
+	Info = [
+		{entries, gb_trees:size(Memo#memo.entries)},
+		{max_entries, Memo#memo.max_entries},
+		{bytes, Memo#memo.bytes},
+		{max_bytes, Memo#memo.max_bytes},
+		{hits, Memo#memo.hits},
+		{misses, Memo#memo.misses}
+	],
+	{reply, Info, State};
+handle_call(stop, _From, #state{running=Running} = State) ->
+	case gb_trees:is_empty(Running) of
+		true ->
+			?LOG_DEBUG(handle_call, [stop, State]),
+			{stop, normal, ok, State};
+		false ->
+			?LOG_DEBUG(handle_call, [{busy, stop}, State]),
+			{reply, {error, busy}, State}
+	end.
 
 handle_cast(_Request, State) ->
 	{noreply, State}.
@@ -154,13 +319,54 @@ handle_info({Port, {data, {eol, S}}}, #state{port=Port} = State) ->
 	{noreply, eol_port_data(S, State)};
 
 % Finally, we can get proper returns coming from the Lua Node:
-% error message or return value message.
-handle_info({error, _Reason} = Error, #state{from=From} = State) when From =/= undefined ->
-	gen_server:reply(From, Error),
-	{noreply, State#state{from=undefined}};
-handle_info({lua, _Result} = Reply, #state{from=From} = State) when From =/= undefined ->
-	gen_server:reply(From, Reply),
-	{noreply, State#state{from=undefined}};
+% error message or return value message, tagged with the request's Seq.
+% The result of a memo call is remembered even if its caller has given up.
+handle_info({reply, Seq, Reply}, #state{running=Running, memo=Memo} = State) ->
+	case gb_trees:lookup(Seq, Running) of
+		{value, {_Key, From, Request_Memo, Timer}} ->
+			cancel_deadline(Timer),
+			case From of
+				expired -> ok;
+				_ -> gen_server:reply(From, Reply)
+			end,
+			New_Memo = memo_update(Request_Memo, Reply, Memo),
+			{noreply, dispatch(State#state{running=gb_trees:delete(Seq, Running), memo=New_Memo})};
+		none ->
+			?LOG_DEBUG(handle_info, [{info, {reply, Seq, Reply}}, State]),
+			{noreply, State}
+	end;
+
+% The Lua Node asks us to make its erl_rpc() calls, so that it can get on
+% with other requests meanwhile. Like rpc:call/4, failures are returned
+% as {badrpc, Reason}.
+handle_info({rpc, Seq, Mod, Fun, Args}, #state{mbox=Mbox} = State) ->
+	spawn(fun () ->
+		Result = case catch apply(Mod, Fun, Args) of
+			{'EXIT', Reason} -> {badrpc, {'EXIT', Reason}};
+			Other -> Other
+		end,
+		Mbox ! {rpc_reply, self(), Seq, Result}
+	end),
+	{noreply, State};
+
+% Deadline timers: the request is either still running on the Lua Node,
+% in which case its caller is answered now and the eventual result is
+% discarded, or it is still queued and is dropped. A timer is cancelled
+% once its request is answered; one that fired just before that is ignored.
+handle_info({deadline, {_, _, Seq} = Key}, #state{running=Running, queue=Queue} = State) ->
+	case {gb_trees:lookup(Seq, Running), gb_trees:lookup(Key, Queue)} of
+		{{value, {Key, From, Memo, _Timer}}, _} when From =/= expired ->
+			?LOG_DEBUG(handle_info, [{expired, running}, State]),
+			gen_server:reply(From, {error, timeout}),
+			{noreply, State#state{running=gb_trees:update(Seq, {Key, expired, Memo, undefined}, Running),
+					expired=State#state.expired+1}};
+		{_, {value, {Request, From, _Memo, _Timer}}} ->
+			?LOG_DEBUG(handle_info, [{expired, Request}, State]),
+			gen_server:reply(From, {error, timeout}),
+			{noreply, State#state{queue=gb_trees:delete(Key, Queue), expired=State#state.expired+1}};
+		_ ->
+			{noreply, State}
+	end;
 
 % Anything else is weird and should, at least, be logged.
 handle_info(Info, State) ->
@@ -211,6 +417,247 @@ code_change(_Old, State, _Extra) ->
 
 % Helper functions.
 
+% Requests wait in a queue ordered by {Priority, Deadline, Seq}; since
+% numbers sort before atoms, requests without a deadline ('infinity')
+% come after those with one of the same priority. Requests are sent to
+% the Lua Node as long as fewer than 'concurrency' are running there,
+% each tagged with its Seq; any request whose deadline has passed by
+% then is answered with {error, timeout} instead.
+% Memo tells what the request does to the remembered results: 'clear'
+% them, add its own under Memo_Key, or 'none'.
+enqueue(Request, Memo, Options, From, #state{seq=Seq} = State) ->
+	Key = {priority(Options), deadline(Options), Seq},
+	case expired(Key, now_ms()) of
+		true ->
+			?LOG_DEBUG(enqueue, [{expired, Request}, State]),
+			{reply, {error, timeout}, State#state{seq=Seq+1, expired=State#state.expired+1}};
+		false ->
+			{noreply, dispatch(insert(Key, {Request, From, Memo}, State#state{seq=Seq+1}))}
+	end.
+
+insert(Key, Entry, #state{queue=Queue, max_queue=Max_Queue} = State) ->
+	case has_free_slot(State) orelse gb_trees:size(Queue) < Max_Queue of
+		true -> queue_in(Key, Entry, State);
+		false -> shed(Key, Entry, State)
+	end.
+
+queue_in({_, Deadline, _} = Key, {Request, From, Memo}, #state{queue=Queue} = State) ->
+	Timer = case Deadline of
+		infinity -> undefined;
+		_ -> erlang:send_after(max(0, Deadline - now_ms()), self(), {deadline, Key})
+	end,
+	State#state{queue=gb_trees:insert(Key, {Request, From, Memo, Timer}, Queue)}.
+
+% A request answered before its deadline has no more use for its timer.
+cancel_deadline(undefined) ->
+	ok;
+cancel_deadline(Timer) ->
+	erlang:cancel_timer(Timer),
+	ok.
+
+% The queue is full, so the least urgent of the newcomer and the last
+% queued request is turned away.
+shed(Key, {Request, From, _Memo} = Entry, #state{queue=Queue, shed=Shed} = State) ->
+	case gb_trees:is_empty(Queue) orelse Key > element(1, gb_trees:largest(Queue)) of
+		true ->
+			?LOG_WARNING(shed, [{shed, Request}, State]),
+			gen_server:reply(From, {error, busy}),
+			State#state{shed=Shed+1};
+		false ->
+			{Last_Key, {Last_Request, Last_From, _, Last_Timer}} = gb_trees:largest(Queue),
+			?LOG_WARNING(shed, [{shed, Last_Request}, State]),
+			cancel_deadline(Last_Timer),
+			gen_server:reply(Last_From, {error, busy}),
+			queue_in(Key, Entry, State#state{queue=gb_trees:delete(Last_Key, Queue), shed=Shed+1})
+	end.
+
+has_free_slot(#state{running=Running, concurrency=Concurrency}) ->
+	gb_trees:size(Running) < Concurrency.
+
+dispatch(#state{queue=Queue, running=Running, mbox=Mbox, memo=Memo} = State) ->
+	case gb_trees:is_empty(Queue) orelse not has_free_slot(State) of
+		true ->
+			State;
+		false ->
+			{{_, _, Seq} = Key, {Request, From, Request_Memo, Timer}, Rest} = gb_trees:take_smallest(Queue),
+			case expired(Key, now_ms()) of
+				true ->
+					?LOG_DEBUG(dispatch, [{expired, Request}, State]),
+					cancel_deadline(Timer),
+					gen_server:reply(From, {error, timeout}),
+					dispatch(State#state{queue=Rest, expired=State#state.expired+1});
+				false ->
+					?LOG_DEBUG(dispatch, [Request, State]),
+					case Request of
+						{exec, Code, Env} -> Mbox ! {exec, self(), Code, [], Env, Seq};
+						{call, Fun, Args, Env} -> Mbox ! {call, self(), Fun, Args, Env, Seq};
+						{drop_env, Env} -> Mbox ! {drop_env, self(), Env, [], [], Seq}
+					end,
+					{Running_Memo, New_Memo} = case Request_Memo of
+						none -> {none, Memo};
+						clear -> {clear, memo_clear(Memo)};
+						Memo_Key -> {{Memo_Key, Memo#memo.generation}, Memo}
+					end,
+					dispatch(State#state{queue=Rest, running=gb_trees:insert(Seq, {Key, From, Running_Memo, Timer}, Running),
+							memo=New_Memo})
+			end
+	end.
+
+% Remembered results are looked up by {Fun, Env, term_to_binary(Args)},
+% so that only exactly equal arguments match (1 and 1.0 do not). Code
+% run by lua/2,3 or drop_env/2 may redefine functions, so the results
+% are forgotten both when such a request is sent to the Lua Node and
+% when it completes; a memo call that was running across either point
+% belongs to an older generation, and its result is not kept.
+memo_lookup(Memo_Key, #memo{entries=Entries, lru=Lru, stamp=Stamp, hits=Hits, misses=Misses} = Memo) ->
+	case gb_trees:lookup(Memo_Key, Entries) of
+		{value, {Old_Stamp, Size, Reply}} ->
+			{hit, Reply, Memo#memo{
+				entries=gb_trees:update(Memo_Key, {Stamp, Size, Reply}, Entries),
+				lru=gb_trees:insert(Stamp, Memo_Key, gb_trees:delete(Old_Stamp, Lru)),
+				stamp=Stamp+1,
+				hits=Hits+1
+			}};
+		none ->
+			{miss, Memo#memo{misses=Misses+1}}
+	end.
+
+memo_update(none, _Reply, Memo) ->
+	Memo;
+memo_update(clear, _Reply, Memo) ->
+	memo_clear(Memo);
+memo_update({Memo_Key, Generation}, {lua, _} = Reply, #memo{generation=Generation} = Memo) ->
+	memo_store(Memo_Key, Reply, Memo);
+memo_update({_Memo_Key, _Generation}, _Reply, Memo) ->
+	Memo.
+
+memo_store(Memo_Key, Reply, #memo{max_entries=Max_Entries, max_bytes=Max_Bytes} = Memo) ->
+	Size = erlang:external_size(Reply),
+	case Max_Entries > 0 andalso Size =< Max_Bytes of
+		true ->
+			#memo{entries=Entries, lru=Lru, stamp=Stamp, bytes=Bytes} = Room =
+				memo_evict(Size, memo_delete(Memo_Key, Memo)),
+			Room#memo{
+				entries=gb_trees:insert(Memo_Key, {Stamp, Size, Reply}, Entries),
+				lru=gb_trees:insert(Stamp, Memo_Key, Lru),
+				stamp=Stamp+1,
+				bytes=Bytes+Size
+			};
+		false ->
+			Memo
+	end.
+
+% Makes room for an entry of Size bytes, least recently used first.
+memo_evict(Size, #memo{entries=Entries, lru=Lru, bytes=Bytes, max_entries=Max_Entries, max_bytes=Max_Bytes} = Memo) ->
+	case gb_trees:size(Entries) < Max_Entries andalso Bytes + Size =< Max_Bytes of
+		true ->
+			Memo;
+		false ->
+			{_Stamp, Memo_Key} = gb_trees:smallest(Lru),
+			memo_evict(Size, memo_delete(Memo_Key, Memo))
+	end.
+
+memo_delete(Memo_Key, #memo{entries=Entries, lru=Lru, bytes=Bytes} = Memo) ->
+	case gb_trees:lookup(Memo_Key, Entries) of
+		{value, {Stamp, Size, _Reply}} ->
+			Memo#memo{entries=gb_trees:delete(Memo_Key, Entries), lru=gb_trees:delete(Stamp, Lru), bytes=Bytes-Size};
+		none ->
+			Memo
+	end.
+
+memo_clear(#memo{generation=Generation} = Memo) ->
+	Memo#memo{entries=gb_trees:empty(), lru=gb_trees:empty(), bytes=0, generation=Generation+1}.
+
+% The options are checked in the caller's process, by parsing them the
+% way the server will, so that a malformed one cannot crash the server
+% and take every queued and running request down with it.
+valid_options(Options) ->
+	try
+		_ = priority(Options),
+		_ = deadline(Options),
+		_ = env(Options),
+		true
+	catch
+		error:_ -> false
+	end.
+
+priority(Options) ->
+	case proplists:get_value(priority, Options, normal) of
+		high -> 0;
+		normal -> 1;
+		low -> 2
+	end.
+
+deadline(Options) ->
+	case proplists:get_value(deadline, Options) of
+		undefined ->
+			case proplists:get_value(timeout, Options, infinity) of
+				infinity -> infinity;
+				Timeout when is_integer(Timeout), Timeout >= 0 -> now_ms() + Timeout
+			end;
+		Timestamp ->
+			now_ms() + (timestamp_ms(Timestamp) - timestamp_ms(os:timestamp()))
+	end.
+
+% The Lua Node takes [] to mean the global environment.
+env(Options) ->
+	case proplists:get_value(env, Options) of
+		undefined -> [];
+		Env when is_atom(Env) -> Env
+	end.
+
+expired({_, infinity, _}, _Now) ->
+	false;
+expired({_, Deadline, _}, Now) ->
+	Deadline =< Now.
+
+% Deadlines are kept in monotonic time, so that a step of the system
+% clock does not expire requests early or late; an absolute deadline is
+% converted when the request arrives.
+now_ms() ->
+	erlang:monotonic_time(millisecond).
+
+timestamp_ms({Megasecs, Secs, Microsecs}) ->
+	(Megasecs * 1000000 + Secs) * 1000 + Microsecs div 1000.
+
+% A dataset file is laid out as described with erl_dataset() in
+% lua_enode.c; offsets and lengths are 32 bit, so it must stay below
+% 4 GiB.
+dataset_key(Key) when is_binary(Key) -> Key;
+dataset_key(Key) when is_atom(Key) -> atom_to_binary(Key, utf8).
+
+dataset_slots(N, Slots) when Slots >= N -> Slots;
+dataset_slots(N, Slots) -> dataset_slots(N, 2 * Slots).
+
+% Linear probing from the slot of the hash on.
+dataset_insert(Slot, Offset, Table) ->
+	case array:get(Slot, Table) of
+		0 -> array:set(Slot, Offset, Table);
+		_ -> dataset_insert((Slot + 1) rem array:size(Table), Offset, Table)
+	end.
+
+% Written next to File first, so that File is replaced in one go.
+write_dataset(File, Data) ->
+	Tmp = filename:flatten([File, ".", os:getpid(), ".tmp"]),
+	case file:write_file(Tmp, Data) of
+		ok ->
+			case file:rename(Tmp, File) of
+				ok -> ok;
+				Error -> file:delete(Tmp), Error
+			end;
+		Error ->
+			Error
+	end.
+
+% 32 bit FNV-1a, as in lua_enode.c.
+fnv1a(Bin) ->
+	fnv1a(Bin, 2166136261).
+
+fnv1a(<<B, Rest/binary>>, Hash) ->
+	fnv1a(Rest, ((Hash bxor B) * 16777619) band 16#ffffffff);
+fnv1a(<<>>, Hash) ->
+	Hash.
+
 % Messages from the Lua Node program are accumulated and finally
 % logged as info messages.
 
@@ -296,12 +743,24 @@ format_log([ready, #state{id=Id}]) ->
 	io_lib:format("ELua '~s' is ready to accept Lua code.", [Id]);
 format_log([{startup, S}, #state{id=Id}]) ->
 	io_lib:format("ELua '~s' startup message:~n~s", [Id, S]);
-format_log([{exec, Code}, #state{id=Id}]) ->
+format_log([{exec, Code, []}, #state{id=Id}]) ->
 	io_lib:format("ELua '~s' executing:~n~s", [Id, Code]);
-format_log([{call, Fun, Args}, #state{id=Id}]) ->
+format_log([{exec, Code, Env}, #state{id=Id}]) ->
+	io_lib:format("ELua '~s' executing in environment '~s':~n~s", [Id, Env, Code]);
+format_log([{call, Fun, Args, []}, #state{id=Id}]) ->
 	io_lib:format("ELua '~s' calling '~s' with argument list:~n~p", [Id, Fun, Args]);
+format_log([{call, Fun, Args, Env}, #state{id=Id}]) ->
+	io_lib:format("ELua '~s' calling '~s' in environment '~s' with argument list:~n~p", [Id, Fun, Env, Args]);
+format_log([{drop_env, Env}, #state{id=Id}]) ->
+	io_lib:format("ELua '~s' dropping environment '~s'.", [Id, Env]);
 format_log([stop, #state{id=Id}]) ->
 	io_lib:format("ELua '~s' is being asked to stop.", [Id]);
+format_log([{expired, running}, #state{id=Id}]) ->
+	io_lib:format("ELua '~s' is still running a request past its deadline; its result will be discarded.", [Id]);
+format_log([{expired, Request}, #state{id=Id}]) ->
+	io_lib:format("ELua '~s' dropping request past its deadline:~n~p", [Id, Request]);
+format_log([{shed, Request}, #state{id=Id}]) ->
+	io_lib:format("ELua '~s' queue is full; rejecting request:~n~p", [Id, Request]);
 format_log([{busy, Request}, #state{id=Id}]) ->
 	io_lib:format("ELua '~s' is busy; ignoring request:~n~p", [Id, Request]);
 format_log([{'EXIT', {exit_status, 0}}, #state{id=Id}]) ->
@@ -34,6 +34,12 @@ all_test_cases() ->
 	, 	fun return_type_test_cases/1
 	,	fun call_test_cases/1
 	,	fun erl_rpc_test_cases/1
+	,	fun queue_test_cases/1
+	,	fun array_test_cases/1
+	,	fun env_test_cases/1
+	,	fun coroutine_test_cases/1
+	,	fun memo_test_cases/1
+	,	fun dataset_test_cases/1
 	].
 
 startstop_test_cases(Pid) ->
@@ -74,13 +80,23 @@ return_type_test_cases(_Pid) ->
 		,	?_assertEqual( {lua, [1234567890]}, erlang_lua:lua(eunit_testing, <<"return 1234567890">>) )
 		,	?_assertEqual( {lua, [-1234567890]}, erlang_lua:lua(eunit_testing, <<"return -1234567890">>) )
 		,	?_assertEqual( {lua, [trunc(math:pow(2, 31)-1)]},
-					erlang_lua:lua(eunit_testing, <<"return math.pow(2, 31)-1">>) )
+					erlang_lua:lua(eunit_testing, <<"return 2^31-1">>) )
 		,	?_assertEqual( {lua, [trunc(-math:pow(2, 31))]},
-					erlang_lua:lua(eunit_testing, <<"return -math.pow(2, 31)">>) )
+					erlang_lua:lua(eunit_testing, <<"return -2^31">>) )
 		,	?_assertNotEqual( {lua, [12345678901234567890]},
 					erlang_lua:lua(eunit_testing, <<"return 12345678901234567890">>) )
 		,	?_assertNotEqual( {lua, [-12345678901234567890]},
 					erlang_lua:lua(eunit_testing, <<"return -12345678901234567890">>) )
+		,	?_assertEqual( {lua, [math:pow(2, 70), 42]},
+					erlang_lua:call(eunit_testing, select, [1, 1 bsl 70, 42]) )
+		,	?_assertEqual( {lua, [1 bsl 53]}, erlang_lua:call(eunit_testing, tonumber, [1 bsl 53]) )
+		,	?_test( case erlang_lua:lua(eunit_testing, <<"return math.type ~= nil">>) of
+				{lua, [true]} ->  % Lua 5.3 and later have 64 bit integers
+					?assertEqual( {lua, [(1 bsl 62) + 1, -(1 bsl 63)]},
+						erlang_lua:call(eunit_testing, select, [1, (1 bsl 62) + 1, -(1 bsl 63)]) );
+				{lua, [false]} ->
+					ok
+			end )
 		] }
 	,	{ "Float", 
 		[	?_assertEqual( {lua, [0]}, erlang_lua:lua(eunit_testing, <<"return 0.0">>) )
@@ -93,9 +109,9 @@ return_type_test_cases(_Pid) ->
 		,	?_assertEqual( {lua, [1.234E-19]}, erlang_lua:lua(eunit_testing, <<"return 1.234E-19">>) )
 		,	?_assertEqual( {lua, [-1.234E-19]}, erlang_lua:lua(eunit_testing, <<"return -1.234E-19">>) )
 		,	?_assertEqual( {lua, [trunc(math:pow(2, 31))]},
-						erlang_lua:lua(eunit_testing, <<"return math.pow(2, 31)">>) )
+						erlang_lua:lua(eunit_testing, <<"return 2^31">>) )
 		,	?_assertEqual( {lua, [trunc(-(math:pow(2, 31)+1))]},
-						erlang_lua:lua(eunit_testing, <<"return -(math.pow(2, 31)+1)">>) )
+						erlang_lua:lua(eunit_testing, <<"return -(2^31+1)">>) )
 		] }
 	,	{ "String", 
 		[	?_assertEqual( {lua, [<<"">>]}, erlang_lua:lua(eunit_testing, <<"return [[]] ">>) )
@@ -290,6 +306,171 @@ erl_rpc_test_cases(_Pid) ->
 	]
 	}.
 
+queue_test_cases(_Pid) ->
+	{ "Deadlines and queueing",
+	[	?_assertEqual( {error, timeout}, erlang_lua:lua(eunit_testing, <<"return 42">>, [{timeout, 0}]) )
+	,	?_assertEqual( {lua, [42]}, erlang_lua:lua(eunit_testing, <<"return 42">>, [{timeout, 5000}]) )
+	,	?_assertEqual(
+			{lua, [42]},
+			erlang_lua:call(eunit_testing, tonumber, [<<"42">>], [{priority, high}, {timeout, 5000}])
+		)
+	,	?_test( begin
+			Self = self(),
+			Slow = <<"local t = os.clock() + 0.5 while os.clock() < t do end">>,
+			spawn(fun () -> Self ! {slow, erlang_lua:lua(eunit_testing, Slow)} end),
+			timer:sleep(100),
+			Before = erlang_lua:queue_info(eunit_testing),
+			true = proplists:get_value(busy, Before),
+			{error, timeout} = erlang_lua:lua(eunit_testing, <<"return 1">>, [{timeout, 100}]),
+			Info = erlang_lua:queue_info(eunit_testing),
+			0 = proplists:get_value(queue_length, Info),
+			Expired = proplists:get_value(expired, Before) + 1,
+			Expired = proplists:get_value(expired, Info),
+			receive {slow, {lua, ok}} -> ok end,
+			{lua, [1]} = erlang_lua:lua(eunit_testing, <<"return 1">>)
+		end )
+	,	?_assertEqual( {error, badarg}, erlang_lua:lua(eunit_testing, <<"return 1">>, [{timeout, -5}]) )
+	,	?_assertEqual( {error, badarg}, erlang_lua:lua(eunit_testing, <<"return 1">>, [{priority, urgent}]) )
+	,	?_assertEqual( {error, badarg}, erlang_lua:lua(eunit_testing, <<"return 1">>, [{deadline, soon}]) )
+	,	?_assertEqual( {error, badarg}, erlang_lua:call(eunit_testing, tonumber, [1], [{env, "a"}]) )
+	,	?_assertEqual( {lua, [1]}, erlang_lua:lua(eunit_testing, <<"return 1">>) )
+	]
+	}.
+
+array_test_cases(_Pid) ->
+	{ "Packed numeric arrays",
+	[	?_assertEqual( {lua, ok}, erlang_lua:lua(eunit_testing, <<"dofile '../test/some_functions.lua' ">>) )
+	,	?_assertEqual(
+			{lua, [<<1:32/signed-native, -2:32/signed-native, 3:32/signed-native>>]},
+			erlang_lua:lua(eunit_testing, <<"return erl_array('i32', {1, -2, 3})">>)
+		)
+	,	?_assertEqual(
+			{lua, [3, 1.5, 3, 2.5, <<"f64">>]},
+			erlang_lua:call(eunit_testing, array_stats, [erlang_lua:array(f64, [1.5, 2.5, 3.0])])
+		)
+	,	?_assertEqual(
+			{lua, [7]},
+			erlang_lua:call(eunit_testing, array_sum, [erlang_lua:array(f64, [1.5, 2.5, 3.0])])
+		)
+	,	?_assertEqual(
+			{lua, [32]},
+			erlang_lua:call(eunit_testing, array_dot, [erlang_lua:array(i32, [1, 2, 3]), erlang_lua:array(i32, [4, 5, 6])])
+		)
+	,	?_assertEqual(
+			{lua, [element(3, erlang_lua:array(i64, [-2, 4, 6]))]},
+			erlang_lua:call(eunit_testing, array_scale, [erlang_lua:array(i64, [-1, 2, 3]), 2])
+		)
+	,	?_assertEqual(
+			{lua, [nil]},
+			erlang_lua:call(eunit_testing, array_sum, [{erl_array, f64, <<1, 2, 3>>}])
+		)
+	,	?_assertMatch( {error, _}, erlang_lua:call(eunit_testing, array_dot, [erlang_lua:array(i32, [1]), erlang_lua:array(i32, [1, 2])]) )
+	,	?_assertMatch( {error, _}, erlang_lua:lua(eunit_testing, <<"return erl_array('f64', 2^61)">>) )
+	,	?_assertMatch( {error, _}, erlang_lua:lua(eunit_testing, <<"return erl_array('i32', {2^31})">>) )
+	,	?_assertMatch( {error, _}, erlang_lua:lua(eunit_testing, <<"return erl_array('i64', {1, 2}):scale(0.5)">>) )
+	]
+	}.
+
+env_test_cases(_Pid) ->
+	{ "Named environments",
+	[	?_assertEqual( {lua, ok}, erlang_lua:lua(eunit_testing, <<"x = 0 shared = 42">>) )
+	,	?_assertEqual( {lua, ok}, erlang_lua:lua(eunit_testing, <<"x = 1 function f() return x end">>, [{env, a}]) )
+	,	?_assertEqual( {lua, ok}, erlang_lua:lua(eunit_testing, <<"x = 2">>, [{env, b}]) )
+	,	?_assertEqual( {lua, [1]}, erlang_lua:lua(eunit_testing, <<"return x">>, [{env, a}]) )
+	,	?_assertEqual( {lua, [2]}, erlang_lua:lua(eunit_testing, <<"return x">>, [{env, b}]) )
+	,	?_assertEqual( {lua, [0]}, erlang_lua:lua(eunit_testing, <<"return x">>) )
+	,	?_assertEqual( {lua, [42, 42]}, erlang_lua:lua(eunit_testing, <<"return shared, _G.shared">>, [{env, b}]) )
+	,	?_assertEqual( {lua, [1]}, erlang_lua:call(eunit_testing, f, [], [{env, a}]) )
+	,	?_assertMatch( {error, _}, erlang_lua:call(eunit_testing, f, []) )
+	,	?_assertMatch( {error, _}, erlang_lua:call(eunit_testing, f, [], [{env, b}]) )
+	,	?_assertEqual( {lua, [3]}, erlang_lua:call(eunit_testing, tonumber, [<<"3">>], [{env, b}]) )
+	,	?_assertEqual( {lua, [5]}, erlang_lua:lua(eunit_testing, <<"_G.y = 5 return y">>, [{env, a}]) )
+	,	?_assertEqual( {lua, [nil]}, erlang_lua:lua(eunit_testing, <<"return y">>) )
+	,	?_assertEqual( {lua, [false, false]}, erlang_lua:lua(eunit_testing, <<"return getmetatable(_G), (pcall(setmetatable, _G, {}))">>, [{env, a}]) )
+	,	?_assertEqual( {lua, [1]}, erlang_lua:lua(eunit_testing, <<"(loadstring or load)('z = 1')() return z">>, [{env, a}]) )
+	,	?_assertEqual( {lua, [nil]}, erlang_lua:lua(eunit_testing, <<"return z">>) )
+	,	?_assertMatch( {error, _}, erlang_lua:lua(eunit_testing, <<"string.format = nil">>, [{env, a}]) )
+	,	?_assertEqual( {lua, [<<"1">>]}, erlang_lua:lua(eunit_testing, <<"return string.format('%d', 1)">>, [{env, b}]) )
+	,	?_assertEqual( {lua, ok}, erlang_lua:drop_env(eunit_testing, a) )
+	,	?_assertEqual( {lua, [0]}, erlang_lua:lua(eunit_testing, <<"return x">>, [{env, a}]) )
+	]
+	}.
+
+coroutine_test_cases(_Pid) ->
+	{ "Requests as coroutines",
+	[	?_assertEqual( {lua, [1]}, erlang_lua:lua(eunit_testing, <<"erl_yield() return 1">>) )
+	,	?_assertEqual(
+			{lua, [tuple_to_list(date())]},
+			erlang_lua:lua(eunit_testing, <<"return coroutine.wrap(function () return erl_rpc('date') end)()">>)
+		)
+	,	?_assertEqual(
+			{lua, [true, tuple_to_list(date())]},
+			erlang_lua:lua(eunit_testing, <<"return pcall(erl_rpc, 'date')">>)
+		)
+	,	?_assertEqual(
+			{lua, [tuple_to_list(date())]},
+			erlang_lua:lua(eunit_testing, <<"return setmetatable({}, { __index = function (t, k) return erl_rpc(k) end }).date">>)
+		)
+	,	?_assertEqual(
+			{lua, [tuple_to_list(date())]},
+			erlang_lua:lua(eunit_testing, <<"for d in function () return erl_rpc('date') end do return d end">>)
+		)
+	,	?_assertMatch(
+			{lua, [ [<<"badrpc">> | _] ]},
+			erlang_lua:lua(eunit_testing, <<"return erl_rpc('erlang', 'error', 'oops')">>)
+		)
+	,	?_test( begin
+			{ok, _} = erlang_lua:start_link(eunit_concurrent, 0, [{concurrency, 2}]),
+			Self = self(),
+			spawn(fun () ->
+				Self ! {slow, erlang_lua:lua(eunit_concurrent, <<"return erl_rpc('timer', 'sleep', 1000)">>)}
+			end),
+			timer:sleep(100),
+			{Micros, {lua, [1]}} = timer:tc(erlang_lua, lua, [eunit_concurrent, <<"return 1">>]),
+			true = Micros < 500000,
+			1 = proplists:get_value(running, erlang_lua:queue_info(eunit_concurrent)),
+			receive {slow, {lua, [<<"ok">>]}} -> ok end,
+			ok = erlang_lua:stop(eunit_concurrent)
+		end )
+	]
+	}.
+
+memo_test_cases(_Pid) ->
+	{ "Encoded values and memoized calls",
+	[	?_assertEqual( {lua, [[1, 2, 3]]}, erlang_lua:lua(eunit_testing, <<"return erl_encoded{1, 2, 3}">>) )
+	,	?_assertEqual( {lua, [[<<"abc">>, {x}]]}, erlang_lua:lua(eunit_testing, <<"return { erl_encoded'abc', erl_encoded(erl_tuple{erl_atom'x'}) }">>) )
+	,	?_assertEqual( {lua, [[1]]}, erlang_lua:lua(eunit_testing, <<"local t = {1} local e = erl_encoded(t) t[2] = 2 return e">>) )
+	,	?_assertEqual( {lua, [true]}, erlang_lua:lua(eunit_testing, <<"return #erl_encoded(1) > 0">>) )
+	,	?_assertEqual( {lua, ok}, erlang_lua:lua(eunit_testing, <<"calls = 0 function counted(x) calls = calls + 1 return x, calls end">>) )
+	,	?_assertEqual( {lua, [7, 1]}, erlang_lua:call(eunit_testing, counted, [7], [memo]) )
+	,	?_assertEqual( {lua, [7, 1]}, erlang_lua:call(eunit_testing, counted, [7], [memo]) )
+	,	?_assertEqual( {lua, [8, 2]}, erlang_lua:call(eunit_testing, counted, [8], [memo]) )
+	,	?_assertEqual( {lua, [7, 3]}, erlang_lua:call(eunit_testing, counted, [7.0], [memo]) )
+	,	?_assertEqual( {lua, [7, 4]}, erlang_lua:call(eunit_testing, counted, [7]) )
+	,	?_assertMatch( [{entries, 3}, _, _, _, {hits, 1}, {misses, 3}], erlang_lua:memo_info(eunit_testing) )
+	,	?_assertEqual( {lua, [4]}, erlang_lua:lua(eunit_testing, <<"return calls">>) )
+	,	?_assertEqual( {lua, [7, 5]}, erlang_lua:call(eunit_testing, counted, [7], [memo]) )
+	,	?_assertMatch( [{entries, 1} | _], erlang_lua:memo_info(eunit_testing) )
+	]
+	}.
+
+dataset_test_cases(_Pid) ->
+	File = filename:absname("eunit_dataset.elds"),
+	Open = iolist_to_binary(["rates = erl_dataset '", File, "'"]),
+	{ "Shared datasets",
+	[	?_assertEqual( ok, erlang_lua:publish_dataset(File, [{eur, 1.5}, {<<"gbp">>, 0.85}, {list, [1, 2, 3]}]) )
+	,	?_assertEqual( {lua, ok}, erlang_lua:lua(eunit_testing, Open) )
+	,	?_assertEqual(
+			{lua, [1.5, 0.85, [1, 2, 3], nil, 3]},
+			erlang_lua:lua(eunit_testing, <<"return rates.eur, rates['gbp'], rates.list, rates.usd, #rates">>)
+		)
+	,	?_assertEqual( ok, erlang_lua:publish_dataset(File, [{eur, 2}]) )
+	,	?_assertEqual( {lua, [2, nil, 1]}, erlang_lua:lua(eunit_testing, <<"return rates.eur, rates.gbp, #rates">>) )
+	,	?_assertMatch( {error, _}, erlang_lua:lua(eunit_testing, <<"return erl_dataset 'does_not_exist.elds'">>) )
+	,	?_assertEqual( ok, file:delete(File) )
+	]
+	}.
+
 %error_test_cases(_Pid) ->
 %	[	{"Syntax error", ?_assertEqual( {error, "stdin:1: unexpected symbol near '1'"}, <<"foo = {} 1">> )}
 %	].
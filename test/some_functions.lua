@@ -7,6 +7,7 @@ match = string.match
 sub = string.sub
 substr = string.sub
 gsub = string.gsub
+unpack = unpack or table.unpack
 
 NULL = {}
 
@@ -124,13 +125,14 @@ function capitalize(s)
 end
 
 function element(s, t)
-	local function lookup(k, v)
-		return v == s and k or nil
-	end
 	if type(t) ~= "table" then
 		t = { t }
 	end
-	return table.foreach(t, lookup)
+	for k, v in pairs(t) do
+		if v == s then
+			return k
+		end
+	end
 end
 
 function sql_quote(s)
@@ -223,3 +225,19 @@ end
 function stringify_flat(o, depth, prefix, references)
 	return stringify(o, false, depth, prefix, references)
 end
+
+function array_stats(a)
+	return #a, a:min(), a:max(), a[2], a:type()
+end
+
+function array_sum(a)
+	return a and a:sum()
+end
+
+function array_dot(a, b)
+	return a:dot(b)
+end
+
+function array_scale(a, k)
+	return a:scale(k)
+end